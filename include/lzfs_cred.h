@@ -0,0 +1,15 @@
+#ifndef _LZFS_CRED_H
+#define _LZFS_CRED_H
+
+#include <linux/cred.h>
+#include <sys/cred.h>
+
+/*
+ * The caller's credentials, borrowed for a synchronous operation.  A
+ * task's own cred cannot be freed under it, so no reference is taken
+ * and nothing is released.  Work that outlives the call, such as taskq
+ * jobs, still pins the cred with get_current_cred().
+ */
+#define LZFS_CRED()	((cred_t *) current_cred())
+
+#endif /* _LZFS_CRED_H */
@@ -1,8 +1,51 @@
 #ifndef _LZFS_INODE_H
 #define _LZFS_INODE_H
 
+#include <linux/stat.h>
+#include <linux/spinlock.h>
+#include <sys/vnode.h>
+#include <sys/vfs.h>
+
+/*
+ * In memory LZFS inode.  zfs only knows the vnode_t and Linux only the
+ * inode embedded in it, lzfs private state sits alongside.  Allocated
+ * from lzfs_inode_cache, see lzfs_alloc_vnode.
+ */
+typedef struct lzfs_inode {
+	vnode_t		li_vnode;
+
+	/* getattr cache for "attrcache" mounts, under li_stat_lock */
+	spinlock_t	li_stat_lock;
+	struct kstat	li_stat;
+	unsigned long	li_stat_time;	/* jiffies when li_stat was filled */
+	int		li_stat_gen_cached;
+	atomic_t	li_stat_gen;	/* bumped whenever attributes change */
+} lzfs_inode_t;
+
+#define LZFS_ITOLI(inode)	\
+	container_of(LZFS_ITOV(inode), lzfs_inode_t, li_vnode)
+
+/*
+ * Called by every path that changes what zfs_getattr would return, so a
+ * cached stat can never outlive the change.
+ */
+static inline void
+lzfs_attr_invalidate(struct inode *inode)
+{
+	atomic_inc(&LZFS_ITOLI(inode)->li_stat_gen);
+}
+
+/* reads only move atime, and only on atime mounts */
+static inline void
+lzfs_attr_accessed(struct inode *inode)
+{
+	if (LZFS_ITOV(inode)->v_vfsp->vfs_flag & VFS_ATIME)
+		lzfs_attr_invalidate(inode);
+}
+
 extern void
 lzfs_set_inode_ops(struct inode *inode);
 
 extern struct file_system_type lzfs_fs_type;
+extern const struct dentry_operations lzfs_dentry_operations;
 #endif /* _LZFS_INODE_H */
@@ -0,0 +1,173 @@
+#ifndef _LZFS_OPSTAT_H
+#define _LZFS_OPSTAT_H
+
+#include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <lzfs_super.h>
+
+/*
+ * Per mount call counts and latency histograms for the lzfs entry points,
+ * exported as /proc/fs/lzfs/<dataset>-<major>:<minor>/opstats, with '/'
+ * in the dataset name replaced by '!' and <major>:<minor> the st_dev of
+ * the mount's files.  Counters are per cpu and updated with preemption
+ * disabled, no lock is taken on the op path.  Writing to the file resets
+ * them.
+ *
+ * Bytes moved, split by the path they took, go to iostats next to it.
+ * Every timed call also fires the lzfs:lzfs_<op> trace event, see
+ * lzfs_trace.h.
+ */
+#define LZFS_OPS(X)					\
+	/* inode operations */				\
+	X(lookup,		LOOKUP)			\
+	X(create,		CREATE)			\
+	X(link,			LINK)			\
+	X(unlink,		UNLINK)			\
+	X(symlink,		SYMLINK)		\
+	X(mkdir,		MKDIR)			\
+	X(rmdir,		RMDIR)			\
+	X(mknod,		MKNOD)			\
+	X(rename,		RENAME)			\
+	X(getattr,		GETATTR)		\
+	X(setattr,		SETATTR)		\
+	X(permission,		PERMISSION)		\
+	X(fallocate,		FALLOCATE)		\
+	X(follow_link,		FOLLOW_LINK)		\
+	X(listxattr,		LISTXATTR)		\
+	X(removexattr,		REMOVEXATTR)		\
+	/* file operations */				\
+	X(open,			OPEN)			\
+	X(llseek,		LLSEEK)			\
+	X(read,			READ)			\
+	X(write,		WRITE)			\
+	X(readdir,		READDIR)		\
+	X(mmap,			MMAP)			\
+	X(fsync,		FSYNC)			\
+	X(aio_read,		AIO_READ)		\
+	X(aio_write,		AIO_WRITE)		\
+	X(splice_read,		SPLICE_READ)		\
+	X(splice_write,		SPLICE_WRITE)		\
+	/* address space operations */			\
+	X(readpage,		READPAGE)		\
+	X(readpages,		READPAGES)		\
+	X(writepage,		WRITEPAGE)		\
+	X(writepages,		WRITEPAGES)		\
+	X(write_begin,		WRITE_BEGIN)		\
+	X(write_end,		WRITE_END)		\
+	X(direct_io,		DIRECT_IO)		\
+	/* vm operations */				\
+	X(page_mkwrite,		PAGE_MKWRITE)		\
+	/* xattr handlers */				\
+	X(xattr_get,		XATTR_GET)		\
+	X(xattr_set,		XATTR_SET)		\
+	X(xattr_list,		XATTR_LIST)		\
+	/* export operations */				\
+	X(encode_fh,		ENCODE_FH)		\
+	X(fh_to_dentry,		FH_TO_DENTRY)		\
+	X(get_parent,		GET_PARENT)		\
+	/* super operations */				\
+	X(sync_fs,		SYNC_FS)
+
+#define LZFS_OP_ENUM(name, NAME)	LZFS_OP_##NAME,
+enum {
+	LZFS_OPS(LZFS_OP_ENUM)
+	LZFS_OP_MAX
+};
+
+/* bucket i counts calls that took [2^i, 2^(i+1)) ns, the last is open */
+#define LZFS_OPSTAT_BUCKETS	32
+
+/* I/O paths */
+enum {
+	LZFS_IO_READ,		/* zfs_read into the caller's buffer */
+	LZFS_IO_WRITE,		/* zfs_write from the caller's buffer */
+	LZFS_IO_CACHE_READ,	/* copied out of the page cache, hits or not */
+	LZFS_IO_CACHE_WRITE,	/* written through a page cache page */
+	LZFS_IO_FILL,		/* page cache and mmap fault fills */
+	LZFS_IO_WRITEBACK,	/* dirty pages written back */
+	LZFS_IO_XATTR_READ,
+	LZFS_IO_XATTR_WRITE,
+	LZFS_IO_MAX
+};
+
+typedef struct lzfs_opstat {
+	u64	los_calls[LZFS_OP_MAX];
+	u64	los_hist[LZFS_OP_MAX][LZFS_OPSTAT_BUCKETS];
+	u64	los_io_ops[LZFS_IO_MAX];
+	u64	los_io_bytes[LZFS_IO_MAX];
+} lzfs_opstat_t;
+
+/* one timed call, the last four only feed the trace event */
+typedef struct lzfs_optime {
+	struct super_block *lot_sb;
+	int		lot_op;
+	ktime_t		lot_start;
+	u64		lot_ino;
+	loff_t		lot_off;
+	s64		lot_len;
+	long		lot_rc;
+} lzfs_optime_t;
+
+static inline lzfs_optime_t
+lzfs_opstat_begin(struct super_block *sb, struct inode *inode, int op)
+{
+	lzfs_optime_t ot;
+
+	ot.lot_sb    = sb;
+	ot.lot_op    = op;
+	ot.lot_ino   = inode ? inode->i_ino : 0;
+	ot.lot_off   = 0;
+	ot.lot_len   = 0;
+	ot.lot_rc    = 0;
+	ot.lot_start = ktime_get();
+	return ot;
+}
+
+extern void lzfs_opstat_end(lzfs_optime_t *ot);
+
+/*
+ * Count bytes moved on an I/O path of sb.  The per task read_bytes and
+ * write_bytes that iotop and the cgroups see are charged by the callers,
+ * which know whether the current task is the one the I/O is done for.
+ */
+static inline void
+lzfs_io_account(struct super_block *sb, int path, ssize_t bytes)
+{
+	lzfs_opstat_t *los;
+
+	if (bytes <= 0)
+		return;
+	los = per_cpu_ptr(LZFS_SB(sb)->lsb_opstat, get_cpu());
+	los->los_io_ops[path]++;
+	los->los_io_bytes[path] += bytes;
+	put_cpu();
+}
+
+/*
+ * Times the rest of the enclosing function as op LZFS_OP_<op> on inode.
+ * Must be the last declaration of the function; the sample is taken by
+ * the cleanup handler on whichever path the function returns through.
+ * LZFS_OPSTAT_SB is for the few ops that have no inode yet.
+ */
+#define LZFS_OPSTAT(inode, op)						\
+	lzfs_optime_t __lzfs_ot __attribute__((cleanup(lzfs_opstat_end))) = \
+	    lzfs_opstat_begin((inode)->i_sb, (inode), LZFS_OP_##op)
+
+#define LZFS_OPSTAT_SB(sb, op)						\
+	lzfs_optime_t __lzfs_ot __attribute__((cleanup(lzfs_opstat_end))) = \
+	    lzfs_opstat_begin((sb), NULL, LZFS_OP_##op)
+
+/* file range and result of the call, for the trace event */
+#define LZFS_OPSTAT_IO(off, len)					\
+	do {								\
+		__lzfs_ot.lot_off = (off);				\
+		__lzfs_ot.lot_len = (len);				\
+	} while (0)
+
+#define LZFS_OPSTAT_RC(rc)	(__lzfs_ot.lot_rc = (long) (rc))
+
+extern int lzfs_opstat_init(lzfs_sb_info_t *lsb, const char *osname);
+extern void lzfs_opstat_fini(lzfs_sb_info_t *lsb);
+
+#endif /* _LZFS_OPSTAT_H */
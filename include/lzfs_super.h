@@ -0,0 +1,79 @@
+#ifndef _LZFS_SUPER_H
+#define _LZFS_SUPER_H
+
+#include <linux/fs.h>
+#include <linux/backing-dev.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <sys/vfs.h>
+#include <sys/taskq.h>
+
+struct lzfs_opstat;
+struct proc_dir_entry;
+
+/*
+ * Per mount LZFS state.  The vfs_t handed to zfs must stay the first
+ * member: sb->s_fs_info and v_vfsp point at it and the snapshot code
+ * casts s_fs_info straight to a vfs_t.
+ */
+typedef struct lzfs_sb_info {
+	vfs_t		lsb_vfs;
+	unsigned long	lsb_flags;	/* LZFS_MNT_* mount options */
+	struct lzfs_opstat *lsb_opstat;	/* per cpu, see lzfs_opstat.h */
+	char		*lsb_osname;	/* dataset name */
+	char		*lsb_procname;	/* "<dataset>-<s_dev>", '/' as '!' */
+	struct proc_dir_entry *lsb_proc; /* /proc/fs/lzfs/<lsb_procname> */
+	struct backing_dev_info lsb_bdi;	/* sb->s_bdi, see lzfs_bdi_init */
+
+	/* fsync group commit, see lzfs_vnop_fsync */
+	unsigned int	lsb_fsync_window;	/* usecs, 0 is off */
+	spinlock_t	lsb_fsync_lock;
+	struct list_head lsb_fsync_batch;	/* waiters not yet committed */
+	int		lsb_fsync_leader;	/* the batch has a leader */
+	wait_queue_head_t lsb_fsync_wait;
+
+	/* free space estimate, see lzfs_space_check */
+	spinlock_t	lsb_space_lock;
+	loff_t		lsb_space_avail;	/* bytes, less what was taken */
+	unsigned long	lsb_space_time;		/* jiffies of the statvfs */
+} lzfs_sb_info_t;
+
+/* lsb_flags */
+#define LZFS_MNT_PAGECACHE	0x0001	/* buffered I/O through page cache */
+#define LZFS_MNT_ATTRCACHE	0x0002	/* answer stat from a cached kstat */
+#define LZFS_MNT_READDIRPLUS	0x0004	/* readdir instantiates children */
+#define LZFS_MNT_WRITEBACK	0x0008	/* buffered writes left dirty in cache */
+
+/* longest fsync_window accepted, in usecs */
+#define LZFS_FSYNC_WINDOW_MAX	100000
+
+/* a free space estimate is trusted this long, and this far above empty */
+#define LZFS_SPACE_TTL		HZ
+#define LZFS_SPACE_MARGIN	(64 << 20)
+
+extern struct proc_dir_entry *lzfs_proc_root;	/* /proc/fs/lzfs */
+extern taskq_t *lzfs_fill_taskq;	/* page fill workers, all mounts */
+extern taskq_t *lzfs_aio_taskq;		/* io_submit workers, all mounts */
+
+#define LZFS_VTOSB(vfsp)	container_of(vfsp, lzfs_sb_info_t, lsb_vfs)
+
+static inline lzfs_sb_info_t *
+LZFS_SB(struct super_block *sb)
+{
+	return LZFS_VTOSB((vfs_t *) sb->s_fs_info);
+}
+
+static inline int
+lzfs_mnt_opt(struct inode *inode, unsigned long opt)
+{
+	return ((LZFS_SB(inode->i_sb)->lsb_flags & opt) != 0);
+}
+
+/* zfs keeps vfs_bsize in step with the dataset recordsize */
+static inline unsigned long
+lzfs_recordsize(struct inode *inode)
+{
+	return (LZFS_SB(inode->i_sb)->lsb_vfs.vfs_bsize);
+}
+#endif /* _LZFS_SUPER_H */
@@ -0,0 +1,50 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lzfs
+
+#if !defined(_LZFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LZFS_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <lzfs_opstat.h>
+
+/*
+ * lzfs:lzfs_<op>, one event per entry point in LZFS_OPS, fired when the
+ * call returns.  Disabled, an event costs the single unlikely() test of
+ * its tracepoint.  Kernels with jump labels patch even that out.
+ */
+#define LZFS_OP_EVENT(name, NAME)					\
+TRACE_EVENT(lzfs_##name,						\
+	TP_PROTO(const lzfs_optime_t *ot, u64 ns),			\
+	TP_ARGS(ot, ns),						\
+	TP_STRUCT__entry(						\
+		__string(dataset, LZFS_SB(ot->lot_sb)->lsb_osname)	\
+		__field(u64,	ino)					\
+		__field(loff_t,	off)					\
+		__field(s64,	len)					\
+		__field(long,	rc)					\
+		__field(u64,	ns)					\
+	),								\
+	TP_fast_assign(							\
+		__assign_str(dataset, LZFS_SB(ot->lot_sb)->lsb_osname);	\
+		__entry->ino	= ot->lot_ino;				\
+		__entry->off	= ot->lot_off;				\
+		__entry->len	= ot->lot_len;				\
+		__entry->rc	= ot->lot_rc;				\
+		__entry->ns	= ns;					\
+	),								\
+	TP_printk("%s ino %llu off %lld len %lld rc %ld %llu ns",	\
+		__get_str(dataset), (unsigned long long) __entry->ino,	\
+		(long long) __entry->off, (long long) __entry->len,	\
+		__entry->rc, (unsigned long long) __entry->ns)		\
+);
+
+LZFS_OPS(LZFS_OP_EVENT)
+
+#endif /* _LZFS_TRACE_H */
+
+/* lzfs_trace.h sits in the include directory, not in include/trace */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lzfs_trace
+#include <trace/define_trace.h>
@@ -8,6 +8,13 @@ extern struct xattr_handler *lzfs_xattr_handlers[];
 extern const struct xattr_handler *lzfs_xattr_handlers[];
 #endif
 
+/* the handlers take an inode before 2.6.35 and a dentry from then on */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35)
+#define LZFS_XATTR_INODE	(inode)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+#define LZFS_XATTR_INODE	(dentry->d_inode)
+#endif
+
 ssize_t
 lzfs_listxattr(struct dentry *dentry, char *buffer, size_t size);
 
@@ -27,6 +27,8 @@
 #include <sys/tsd_wrapper.h>
 #include <sys/vnode.h>
 #include <spl-debug.h>
+#include <lzfs_cred.h>
+#include <lzfs_opstat.h>
 
 #ifdef SS_DEBUG_SUBSYS
 #undef SS_DEBUG_SUBSYS
@@ -50,8 +52,8 @@ static int lzfs_encode_fh(struct dentry *dentry, u32 *fh, int *max_len, int conn
 	int lfid_type = LZFS_FILEID_INO64_GEN;
 	vnode_t *vp;
 	int error = 0;
+	LZFS_OPSTAT(dentry->d_inode, ENCODE_FH);
 
-	SENTRY;
 	lzfid->fid_len = *max_len;
 	if (!(S_ISDIR(inode->i_mode) || !connectable)) {
 		spin_lock(&dentry->d_lock);
@@ -69,7 +71,6 @@ static int lzfs_encode_fh(struct dentry *dentry, u32 *fh, int *max_len, int conn
 	vp = LZFS_ITOV(inode);
 	error = zfs_fid( vp, lzfid, 0);
 	tsd_exit();
-	SEXIT;
 
 	if (error) {
 		printk(KERN_WARNING "Unable to get file handle \n");
@@ -89,8 +90,8 @@ struct dentry * lzfs_fh_to_dentry(struct super_block *sb, struct fid *fid,
 	vnode_t *vp;
 	int error = 0;
 	struct dentry *dentry = NULL;
+	LZFS_OPSTAT_SB(sb, FH_TO_DENTRY);
 
-	SENTRY;
 	if (fh_len < 2) {
 		return NULL;
 	}
@@ -103,7 +104,6 @@ struct dentry * lzfs_fh_to_dentry(struct super_block *sb, struct fid *fid,
 	}
 
 	tsd_exit();
-	SEXIT;
 	if (error) {
 		printk(KERN_WARNING "Unable to get vnode \n");
 		return NULL;
@@ -120,15 +120,13 @@ struct dentry *lzfs_get_parent(struct dentry *child)
 	vnode_t *vp;
 	int error = 0;
 	struct dentry *dentry = NULL;
-	const struct cred *cred = get_current_cred();
+	cred_t *cred = LZFS_CRED();
+	LZFS_OPSTAT(child->d_inode, GET_PARENT);
 
-	SENTRY;
 	error = zfs_lookup(vcp, "..", &vp, NULL, 0 , NULL,
 			(struct cred *) cred, NULL, NULL, NULL);
 
-	put_cred(cred);
 	tsd_exit();
-	SEXIT;
 	if (error) {
 		if (error == ENOENT) {
 			printk(KERN_WARNING "Try to get new dentry \n");
@@ -0,0 +1,241 @@
+/*
+ *  This file is part of the LZPL: Linux ZFS Posix Layer
+ *
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/bitops.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <lzfs_super.h>
+#include <lzfs_opstat.h>
+
+#define CREATE_TRACE_POINTS
+#include <lzfs_trace.h>
+
+#define LZFS_OP_NAME(name, NAME)	[LZFS_OP_##NAME] = #name,
+static const char *lzfs_op_names[LZFS_OP_MAX] = {
+	LZFS_OPS(LZFS_OP_NAME)
+};
+
+static const char *lzfs_io_names[LZFS_IO_MAX] = {
+	[LZFS_IO_READ]		= "read",
+	[LZFS_IO_WRITE]		= "write",
+	[LZFS_IO_CACHE_READ]	= "cache_read",
+	[LZFS_IO_CACHE_WRITE]	= "cache_write",
+	[LZFS_IO_FILL]		= "fill",
+	[LZFS_IO_WRITEBACK]	= "writeback",
+	[LZFS_IO_XATTR_READ]	= "xattr_read",
+	[LZFS_IO_XATTR_WRITE]	= "xattr_write",
+};
+
+void
+lzfs_opstat_end(lzfs_optime_t *ot)
+{
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), ot->lot_start));
+	int bucket = 0;
+	lzfs_opstat_t *los;
+
+	if (ns > 0)
+		bucket = min(fls64(ns) - 1, LZFS_OPSTAT_BUCKETS - 1);
+
+	los = per_cpu_ptr(LZFS_SB(ot->lot_sb)->lsb_opstat, get_cpu());
+	los->los_calls[ot->lot_op]++;
+	los->los_hist[ot->lot_op][bucket]++;
+	put_cpu();
+
+	switch (ot->lot_op) {
+#define LZFS_OP_TRACE(name, NAME)					\
+	case LZFS_OP_##NAME:						\
+		trace_lzfs_##name(ot, ns);				\
+		break;
+	LZFS_OPS(LZFS_OP_TRACE)
+	}
+}
+
+/* the counters summed over all cpus, freed by the caller */
+static lzfs_opstat_t *
+lzfs_opstat_sum(lzfs_sb_info_t *lsb)
+{
+	lzfs_opstat_t *sum;
+	int cpu, op, i;
+
+	sum = kzalloc(sizeof (lzfs_opstat_t), GFP_KERNEL);
+	if (!sum)
+		return NULL;
+
+	for_each_possible_cpu(cpu) {
+		lzfs_opstat_t *los = per_cpu_ptr(lsb->lsb_opstat, cpu);
+
+		for (op = 0; op < LZFS_OP_MAX; op++) {
+			sum->los_calls[op] += los->los_calls[op];
+			for (i = 0; i < LZFS_OPSTAT_BUCKETS; i++)
+				sum->los_hist[op][i] += los->los_hist[op][i];
+		}
+		for (i = 0; i < LZFS_IO_MAX; i++) {
+			sum->los_io_ops[i]   += los->los_io_ops[i];
+			sum->los_io_bytes[i] += los->los_io_bytes[i];
+		}
+	}
+	return sum;
+}
+
+static int
+lzfs_opstat_show(struct seq_file *m, void *v)
+{
+	lzfs_opstat_t *sum;
+	int op, i;
+
+	sum = lzfs_opstat_sum(m->private);
+	if (!sum)
+		return -ENOMEM;
+
+	seq_printf(m, "# op calls, then calls per bucket; "
+			"bucket i is [2^i, 2^(i+1)) ns\n");
+	for (op = 0; op < LZFS_OP_MAX; op++) {
+		seq_printf(m, "%-14s %llu", lzfs_op_names[op],
+				(unsigned long long) sum->los_calls[op]);
+		for (i = 0; i < LZFS_OPSTAT_BUCKETS; i++)
+			seq_printf(m, " %llu",
+				(unsigned long long) sum->los_hist[op][i]);
+		seq_putc(m, '\n');
+	}
+	kfree(sum);
+	return 0;
+}
+
+static int
+lzfs_iostat_show(struct seq_file *m, void *v)
+{
+	lzfs_opstat_t *sum;
+	int i;
+
+	sum = lzfs_opstat_sum(m->private);
+	if (!sum)
+		return -ENOMEM;
+
+	seq_printf(m, "# path ops bytes\n");
+	for (i = 0; i < LZFS_IO_MAX; i++)
+		seq_printf(m, "%-14s %llu %llu\n", lzfs_io_names[i],
+				(unsigned long long) sum->los_io_ops[i],
+				(unsigned long long) sum->los_io_bytes[i]);
+	kfree(sum);
+	return 0;
+}
+
+static int
+lzfs_opstat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lzfs_opstat_show, PDE(inode)->data);
+}
+
+static int
+lzfs_iostat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lzfs_iostat_show, PDE(inode)->data);
+}
+
+/* a write to either file resets all counters of the mount */
+static ssize_t
+lzfs_opstat_write(struct file *file, const char __user *buf, size_t len,
+		loff_t *ppos)
+{
+	lzfs_sb_info_t *lsb = PDE(file->f_path.dentry->d_inode)->data;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(lsb->lsb_opstat, cpu), 0,
+				sizeof (lzfs_opstat_t));
+	return len;
+}
+
+static const struct file_operations lzfs_opstat_fops = {
+	.owner		= THIS_MODULE,
+	.open		= lzfs_opstat_open,
+	.read		= seq_read,
+	.write		= lzfs_opstat_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const struct file_operations lzfs_iostat_fops = {
+	.owner		= THIS_MODULE,
+	.open		= lzfs_iostat_open,
+	.read		= seq_read,
+	.write		= lzfs_opstat_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+int
+lzfs_opstat_init(lzfs_sb_info_t *lsb, const char *osname)
+{
+	dev_t dev = lsb->lsb_vfs.vfs_super->s_dev;
+	char *p;
+
+	lsb->lsb_opstat = alloc_percpu(lzfs_opstat_t);
+	lsb->lsb_osname = kstrdup(osname, GFP_KERNEL);
+	if (!lsb->lsb_opstat || !lsb->lsb_osname)
+		return -ENOMEM;
+
+	/* the proc entries are a convenience, a mount never fails on them */
+	if (!lzfs_proc_root)
+		return 0;
+	/*
+	 * The superblock's dev_t tells apart two mounts of one dataset, and
+	 * datasets differing only in '/' against '!'.  It goes after the
+	 * last '-' of the name, so no two live mounts can share one.
+	 */
+	lsb->lsb_procname = kasprintf(GFP_KERNEL, "%s-%u:%u", osname,
+			MAJOR(dev), MINOR(dev));
+	if (!lsb->lsb_procname)
+		return 0;
+	for (p = lsb->lsb_procname; *p; p++)
+		if (*p == '/')
+			*p = '!';
+
+	lsb->lsb_proc = proc_mkdir(lsb->lsb_procname, lzfs_proc_root);
+	if (lsb->lsb_proc) {
+		proc_create_data("opstats", 0644, lsb->lsb_proc,
+				&lzfs_opstat_fops, lsb);
+		proc_create_data("iostats", 0644, lsb->lsb_proc,
+				&lzfs_iostat_fops, lsb);
+	}
+	return 0;
+}
+
+void
+lzfs_opstat_fini(lzfs_sb_info_t *lsb)
+{
+	if (lsb->lsb_proc) {
+		remove_proc_entry("iostats", lsb->lsb_proc);
+		remove_proc_entry("opstats", lsb->lsb_proc);
+		remove_proc_entry(lsb->lsb_procname, lzfs_proc_root);
+		lsb->lsb_proc = NULL;
+	}
+	kfree(lsb->lsb_procname);
+	lsb->lsb_procname = NULL;
+	kfree(lsb->lsb_osname);
+	lsb->lsb_osname = NULL;
+	if (lsb->lsb_opstat) {
+		free_percpu(lsb->lsb_opstat);
+		lsb->lsb_opstat = NULL;
+	}
+}
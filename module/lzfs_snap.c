@@ -401,8 +401,8 @@ lzfs_zfsctl_create(vfs_t *vfsp)
 	}
 	return;
 dentry_out:
-	// free vnode
-	vn_free(vp_zfsctl_dir);
+	// free vnode, it came from iget_locked
+	iput(LZFS_VTOI(vp_zfsctl_dir));
 	ASSERT(0 && "TODO");
 }
 
@@ -33,6 +33,9 @@
 #include <linux/parser.h>
 #include <linux/statfs.h>
 #include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/proc_fs.h>
+#include <linux/percpu_counter.h>
 #include <asm/uaccess.h>
 #include <sys/vfs.h>
 #include <sys/vnode.h>
@@ -41,6 +44,9 @@
 #include <lzfs_snap.h>
 #include <lzfs_exportfs.h>
 #include <lzfs_xattr.h>
+#include <lzfs_super.h>
+#include <lzfs_opstat.h>
+#include <lzfs_cred.h>
 #include <linux/version.h>
 #include <sys/mntent.h>
 #include <spl_config.h>
@@ -62,6 +68,17 @@ extern int zfs_statvfs(vfs_t *vfsp, struct statvfs64 *statp);
 extern void lzfs_zfsctl_create(vfs_t *);
 extern void lzfs_zfsctl_destroy(vfs_t *);
 
+static int lzfs_fill_threads = 4;
+module_param(lzfs_fill_threads, int, 0444);
+MODULE_PARM_DESC(lzfs_fill_threads, "Page fill worker threads");
+
+static int lzfs_aio_threads = 4;
+module_param(lzfs_aio_threads, int, 0444);
+MODULE_PARM_DESC(lzfs_aio_threads, "Asynchronous I/O worker threads");
+
+taskq_t *lzfs_fill_taskq;
+taskq_t *lzfs_aio_taskq;
+
 /* TODO
  * Following checking needs part of lzfs/spl configuration step.
  */
@@ -90,7 +107,6 @@ lzfs_clear_vnode(struct inode *inode)
 {
 	vnode_t		*vp;
 
-	SENTRY;
 	vp = LZFS_ITOV(inode);
 	
 	ASSERT(vp->v_count == 1);
@@ -109,7 +125,6 @@ lzfs_clear_vnode(struct inode *inode)
 			zfs_inactive(vp, NULL, NULL);
 	}
 	vp->v_data = NULL;
-	SEXIT;
 }
 
 static void
@@ -117,35 +132,143 @@ lzfs_put_super(struct super_block *sb)
 {
 	struct dentry *mntpnt = ((vfs_t *)sb->s_fs_info)->vfs_mntpt;
 
-	SENTRY;
+	lzfs_opstat_fini(LZFS_SB(sb));
+	/* no fill of this mount's pages may outlive the znodes */
+	taskq_wait(lzfs_fill_taskq);
 	zfs_umount(sb->s_fs_info, 0, NULL);
 	if(((vfs_t *)sb->s_fs_info)->is_snap) {
 		d_invalidate(mntpnt);
 	}
-	kfree(sb->s_fs_info);
-	SEXIT;
+	bdi_destroy(&LZFS_SB(sb)->lsb_bdi);
+	kfree(LZFS_SB(sb));
+}
+
+/*
+ * lzfs_inode_t objects come from a Linux slab cache rather than the spl
+ * one, so the mutex and the embedded inode are constructed once per
+ * object instead of on every allocation.
+ */
+#undef kmem_cache_create
+#undef kmem_cache_destroy
+#undef kmem_cache_alloc
+#undef kmem_cache_free
+
+static struct kmem_cache *lzfs_inode_cache;
+static struct percpu_counter lzfs_inode_count;
+
+static void
+lzfs_inode_init_once(void *obj)
+{
+	lzfs_inode_t *li = obj;
+
+	mutex_init(&li->li_vnode.v_lock, NULL, MUTEX_DEFAULT, NULL);
+	inode_init_once(LZFS_VTOI(&li->li_vnode));
+	spin_lock_init(&li->li_stat_lock);
+	atomic_set(&li->li_stat_gen, 0);
+}
+
+/*
+ * Zero the vnode except for the constructed v_lock and v_inode,
+ * wherever the spl places them.
+ */
+static void
+lzfs_vnode_clear(vnode_t *vp)
+{
+	size_t a = offsetof(vnode_t, v_lock), alen = sizeof (vp->v_lock);
+	size_t b = offsetof(vnode_t, v_inode), blen = sizeof (vp->v_inode);
+	char *p = (char *) vp;
+
+	if (a > b) {
+		swap(a, b);
+		swap(alen, blen);
+	}
+	memset(p, 0, a);
+	memset(p + a + alen, 0, b - (a + alen));
+	memset(p + b + blen, 0, sizeof (vnode_t) - (b + blen));
 }
 
 static struct inode *
 lzfs_alloc_vnode(struct super_block *sb) 
 {
-	vnode_t *vp = NULL;
+	lzfs_inode_t *li;
+	vnode_t *vp;
 	
-	SENTRY;
-	vp = vn_alloc(KM_SLEEP); 
-	bzero(vp, sizeof(vnode_t));
-	mutex_init(&vp->v_lock, NULL, MUTEX_DEFAULT, NULL);
-	inode_init_once(LZFS_VTOI(vp));
+	li = kmem_cache_alloc(lzfs_inode_cache, GFP_NOFS);
+	if (!li)
+		return NULL;
+	vp = &li->li_vnode;
+	lzfs_vnode_clear(vp);
 	LZFS_VTOI(vp)->i_version = 1;
-	SEXIT;
+	/* whatever the previous user cached is void */
+	li->li_stat_gen_cached = atomic_inc_return(&li->li_stat_gen) - 1;
+	percpu_counter_inc(&lzfs_inode_count);
 	return LZFS_VTOI(vp);
 }
 
 static void
 lzfs_destroy_vnode(struct inode *inode)
 {
-	mutex_destroy(&(LZFS_ITOV(inode))->v_lock);
-	vn_free(LZFS_ITOV(inode));	
+	percpu_counter_dec(&lzfs_inode_count);
+	kmem_cache_free(lzfs_inode_cache, LZFS_ITOLI(inode));
+}
+
+static int
+lzfs_inodes_show(struct seq_file *m, void *v)
+{
+	seq_printf(m, "%lld\n", percpu_counter_sum(&lzfs_inode_count));
+	return 0;
+}
+
+static int
+lzfs_inodes_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lzfs_inodes_show, NULL);
+}
+
+static const struct file_operations lzfs_inodes_fops = {
+	.owner		= THIS_MODULE,
+	.open		= lzfs_inodes_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+struct proc_dir_entry *lzfs_proc_root;
+
+static int
+lzfs_init_inodecache(void)
+{
+	int err;
+
+	err = percpu_counter_init(&lzfs_inode_count, 0);
+	if (err)
+		return err;
+
+	lzfs_inode_cache = kmem_cache_create("lzfs_inode_cache",
+			sizeof (lzfs_inode_t), 0,
+			SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD,
+			lzfs_inode_init_once);
+	if (!lzfs_inode_cache) {
+		percpu_counter_destroy(&lzfs_inode_count);
+		return -ENOMEM;
+	}
+
+	/* /proc/fs/lzfs/inodes: live LZFS inodes */
+	lzfs_proc_root = proc_mkdir("fs/lzfs", NULL);
+	if (lzfs_proc_root)
+		proc_create("inodes", 0444, lzfs_proc_root, &lzfs_inodes_fops);
+	return 0;
+}
+
+static void
+lzfs_destroy_inodecache(void)
+{
+	if (lzfs_proc_root) {
+		remove_proc_entry("inodes", lzfs_proc_root);
+		remove_proc_entry("fs/lzfs", NULL);
+	}
+	kmem_cache_destroy(lzfs_inode_cache);
+	percpu_counter_destroy(&lzfs_inode_count);
 }
 
 /* Structure to keep all the zfs related callback routines.
@@ -178,10 +301,38 @@ static int lzfs_statfs(struct dentry *dentry, struct kstatfs *statfs)
 	return 0;
 }
 
+/* symbol exported by zfs module */
+extern int zfs_sync(vfs_t *vfsp, short flag, cred_t *cr);
+
+/*
+ * sync(2), syncfs(2) and umount.  The VFS only gets here for a mount with
+ * an sb->s_bdi, lzfs_bdi_init provides one, and by then it has written
+ * back the dirty pages of every inode of the mount through
+ * lzfs_writepages, starting them on the nowait pass and waiting for them
+ * on the wait pass.  What is left is to make the dataset durable, done
+ * once for the whole mount with a single ZIL commit on the wait pass.
+ */
+static int
+lzfs_sync_fs(struct super_block *sb, int wait)
+{
+	vfs_t *vfsp = lzfs_super(sb);
+	int err;
+	LZFS_OPSTAT_SB(sb, SYNC_FS);
+
+	/* snapshots have nothing to commit */
+	if (!wait || vfsp->is_snap)
+		return 0;
+
+	err = zfs_sync(vfsp, 0, LZFS_CRED());
+	LZFS_OPSTAT_RC(-err);
+	return -err;
+}
+
 
 static int lzfs_show_options(struct seq_file *seq, struct vfsmount *vfsmnt)
 {
 	vfs_t *vfsp = lzfs_super(vfsmnt->mnt_sb);
+	lzfs_sb_info_t *lsb = LZFS_VTOSB(vfsp);
 /*
 	if (vfs_isreadonly(vfsp))
 		seq_printf(seq, ",%s", MNTOPT_RO);
@@ -226,6 +377,17 @@ static int lzfs_show_options(struct seq_file *seq, struct vfsmount *vfsmnt)
 		/* Linux Kernel Displays noexec by default */
 		// seq_printf(seq, ",%s", MNTOPT_NOEXEC);
 	}
+
+	if (lsb->lsb_flags & LZFS_MNT_WRITEBACK)
+		seq_printf(seq, ",%s", "writeback");
+	else if (lsb->lsb_flags & LZFS_MNT_PAGECACHE)
+		seq_printf(seq, ",%s", "pagecache");
+	if (lsb->lsb_flags & LZFS_MNT_ATTRCACHE)
+		seq_printf(seq, ",%s", "attrcache");
+	if (lsb->lsb_flags & LZFS_MNT_READDIRPLUS)
+		seq_printf(seq, ",%s", "readdirplus");
+	if (lsb->lsb_fsync_window)
+		seq_printf(seq, ",fsync_window=%u", lsb->lsb_fsync_window);
 	return 0;
 }
 
@@ -236,22 +398,54 @@ static const struct super_operations lzfs_ops = {
 	.destroy_inode	=	lzfs_destroy_vnode,
 	.put_super	=	lzfs_put_super,
 	.statfs		= 	lzfs_statfs,
+	.sync_fs	=	lzfs_sync_fs,
 	.show_options = lzfs_show_options,
 };
 
+/*
+ * A mount of its own backing_dev_info.  Without sb->s_bdi sync(2), syncfs
+ * and the sync at umount skip the mount altogether, and with the default
+ * one no flusher thread writes back its dirty pages and inodes.
+ * lzfs_set_inode_ops points every inode's mapping at it.
+ */
+static int
+lzfs_bdi_init(struct super_block *sb, lzfs_sb_info_t *lsb)
+{
+	struct backing_dev_info *bdi = &lsb->lsb_bdi;
+	int err;
+
+	bdi->name	  = "lzfs";
+	bdi->capabilities = BDI_CAP_MAP_COPY;
+	bdi->ra_pages	  = VM_MAX_READAHEAD * 1024 / PAGE_CACHE_SIZE;
+	err = bdi_init(bdi);
+	if (err)
+		return err;
+	err = bdi_register_dev(bdi, sb->s_dev);
+	if (err) {
+		bdi_destroy(bdi);
+		return err;
+	}
+	sb->s_bdi = bdi;
+	return 0;
+}
+
 static int 
 lzfs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	int error = 0;
+	lzfs_sb_info_t *lsb = NULL;
 	vfs_t *vfsp = NULL;
 	vnode_t *root_vnode = NULL;
 	struct inode *root_inode = NULL;
 	struct dentry *root_dentry = NULL;
 	long ret = -EINVAL;
 	
-	SENTRY;
-
-	vfsp = (vfs_t *) kzalloc(sizeof(vfs_t), KM_SLEEP);
+	lsb = kzalloc(sizeof(lzfs_sb_info_t), KM_SLEEP);
+	vfsp = &lsb->lsb_vfs;
+	spin_lock_init(&lsb->lsb_fsync_lock);
+	INIT_LIST_HEAD(&lsb->lsb_fsync_batch);
+	init_waitqueue_head(&lsb->lsb_fsync_wait);
+	spin_lock_init(&lsb->lsb_space_lock);
 	vfsp->vfs_set_inode_ops = lzfs_set_inode_ops;
 	vfsp->vfs_super   =	sb;
 	sb->s_maxbytes	  =	MAX_LFS_FILESIZE;
@@ -260,6 +454,13 @@ lzfs_fill_super(struct super_block *sb, void *data, int silent)
 	sb->s_flags	  =	MS_ACTIVE;
 	sb->s_export_op	  =     &zfs_export_ops;
 	sb->s_xattr       =     lzfs_xattr_handlers;
+	if (lzfs_bdi_init(sb, lsb))
+		goto bdi_failed;
+	error = lzfs_opstat_init(lsb, data);
+	if (error) {
+		ret = error;
+		goto mount_failed;
+	}
 	error = zfs_domount(vfsp, data);
 	if (error) {
 		printk(KERN_WARNING "mount failed to open the pool!!\n");
@@ -292,23 +493,105 @@ lzfs_fill_super(struct super_block *sb, void *data, int silent)
 		goto mount_failed;
 	}
 
+	root_dentry->d_op = &lzfs_dentry_operations;
 	sb->s_root = root_dentry;
 
 	if (!strchr((char *) data, '@')) {
 		lzfs_zfsctl_create(vfsp);
 	}
-	SEXIT;
 	return 0;
 
 mount_failed:
+	bdi_destroy(&lsb->lsb_bdi);
+	sb->s_bdi = NULL;
+bdi_failed:
 	sb->s_fs_info = NULL;
-	kfree(vfsp);
-	SEXIT;
+	lzfs_opstat_fini(lsb);
+	kfree(lsb);
 	return (ret);
 }
 
 extern int zfs_register_callbacks(vfs_t *vfsp);
 
+enum {
+	Opt_pagecache, Opt_nopagecache,
+	Opt_writeback, Opt_nowriteback,
+	Opt_attrcache, Opt_noattrcache,
+	Opt_readdirplus, Opt_noreaddirplus,
+	Opt_fsync_window, Opt_err
+};
+
+static const match_table_t lzfs_tokens = {
+	{ Opt_pagecache,	"pagecache" },
+	{ Opt_nopagecache,	"nopagecache" },
+	{ Opt_writeback,	"writeback" },
+	{ Opt_nowriteback,	"nowriteback" },
+	{ Opt_attrcache,	"attrcache" },
+	{ Opt_noattrcache,	"noattrcache" },
+	{ Opt_readdirplus,	"readdirplus" },
+	{ Opt_noreaddirplus,	"noreaddirplus" },
+	{ Opt_fsync_window,	"fsync_window=%u" },
+	{ Opt_err,		NULL }
+};
+
+/*
+ * Parse the LZFS specific mount options.  Options we do not know about
+ * are ignored, as they always have been, so existing mount scripts keep
+ * working.
+ */
+static void
+lzfs_parse_options(lzfs_sb_info_t *lsb, char *options)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+	int n;
+
+	if (!options)
+		return;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		switch (match_token(p, lzfs_tokens, args)) {
+		case Opt_pagecache:
+			lsb->lsb_flags |= LZFS_MNT_PAGECACHE;
+			break;
+		case Opt_nopagecache:
+			lsb->lsb_flags &= ~(LZFS_MNT_PAGECACHE |
+			    LZFS_MNT_WRITEBACK);
+			break;
+		case Opt_writeback:
+			/* only the page cache path has pages to leave dirty */
+			lsb->lsb_flags |= LZFS_MNT_PAGECACHE |
+			    LZFS_MNT_WRITEBACK;
+			break;
+		case Opt_nowriteback:
+			lsb->lsb_flags &= ~LZFS_MNT_WRITEBACK;
+			break;
+		case Opt_attrcache:
+			lsb->lsb_flags |= LZFS_MNT_ATTRCACHE;
+			break;
+		case Opt_noattrcache:
+			lsb->lsb_flags &= ~LZFS_MNT_ATTRCACHE;
+			break;
+		case Opt_readdirplus:
+			lsb->lsb_flags |= LZFS_MNT_READDIRPLUS;
+			break;
+		case Opt_noreaddirplus:
+			lsb->lsb_flags &= ~LZFS_MNT_READDIRPLUS;
+			break;
+		case Opt_fsync_window:
+			if (!match_int(&args[0], &n) && n >= 0)
+				lsb->lsb_fsync_window =
+				    min(n, LZFS_FSYNC_WINDOW_MAX);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
 static int 
 lzfs_get_sb(struct file_system_type *fs_type,
 	    int flags, const char *dev_name,
@@ -321,7 +604,6 @@ lzfs_get_sb(struct file_system_type *fs_type,
 	 * There is no need for a block device for this file system.
 	 * Let's call get_sb_nodev.
 	 */
-	SENTRY;
 	rc = get_sb_nodev(fs_type, flags, (void *)dev_name, 
 			    lzfs_fill_super, mnt);
 
@@ -360,11 +642,12 @@ lzfs_get_sb(struct file_system_type *fs_type,
 	else
 		vfsp->vfs_flag |= VFS_ATIME;
 
+	lzfs_parse_options(LZFS_VTOSB(vfsp), data);
+
 	if(!vfsp->is_snap) {
 		if ((rc = zfs_register_callbacks(vfsp)))
 			lzfs_zfsctl_destroy(vfsp->vfs_super->s_fs_info);
 	}
-	SEXIT;
 	return rc;
 }
 
@@ -373,7 +656,6 @@ lzfs_kill_sb(struct super_block *sb)
 {
 	vfs_t *vfsp;
 
-	SENTRY;
         if(sb->s_fs_info) {
             vfsp = (vfs_t *) sb->s_fs_info;
             if (!vfsp->is_snap) {
@@ -381,7 +663,6 @@ lzfs_kill_sb(struct super_block *sb)
             }
         }
 	kill_anon_super(sb);
-	SEXIT;
 }
 
 struct file_system_type lzfs_fs_type = {
@@ -391,16 +672,66 @@ struct file_system_type lzfs_fs_type = {
 	.kill_sb	= lzfs_kill_sb,
 };
 
+/*
+ * One pool of each kind serves every mount, so a mount, snapshots
+ * included, costs no threads of its own.
+ */
+static int
+lzfs_init_taskqs(void)
+{
+	lzfs_fill_taskq = taskq_create("lzfs_fill", lzfs_fill_threads,
+			maxclsyspri, lzfs_fill_threads, INT_MAX,
+			TASKQ_PREPOPULATE);
+	if (!lzfs_fill_taskq)
+		return -ENOMEM;
+	lzfs_aio_taskq = taskq_create("lzfs_aio", lzfs_aio_threads,
+			maxclsyspri, lzfs_aio_threads, INT_MAX,
+			TASKQ_PREPOPULATE);
+	if (!lzfs_aio_taskq) {
+		taskq_destroy(lzfs_fill_taskq);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void
+lzfs_destroy_taskqs(void)
+{
+	taskq_destroy(lzfs_aio_taskq);
+	taskq_destroy(lzfs_fill_taskq);
+}
+
 static int 
 init_lzfs_fs(void)
 {
-	return register_filesystem(&lzfs_fs_type);
+	int err;
+
+	err = lzfs_init_taskqs();
+	if (err)
+		return err;
+
+	err = lzfs_init_inodecache();
+	if (err)
+		goto out_taskqs;
+
+	err = register_filesystem(&lzfs_fs_type);
+	if (err)
+		goto out_inodecache;
+	return 0;
+
+out_inodecache:
+	lzfs_destroy_inodecache();
+out_taskqs:
+	lzfs_destroy_taskqs();
+	return err;
 }
 
 static void __exit 
 exit_lzfs_fs(void)
 {
 	unregister_filesystem(&lzfs_fs_type);
+	lzfs_destroy_inodecache();
+	lzfs_destroy_taskqs();
 }
 
 module_init(init_lzfs_fs)
@@ -22,6 +22,16 @@
  */
 
 #include <linux/fs.h>
+#include <linux/pagemap.h>
+#include <linux/aio.h>
+#include <linux/pagevec.h>
+#include <linux/mmu_context.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/falloc.h>
+#include <linux/task_io_accounting_ops.h>
+#include <linux/hrtimer.h>
+#include <sys/statvfs.h>
 #include <sys/vnode.h>
 #include <spl-debug.h>
 #include <sys/tsd.h>
@@ -30,6 +40,10 @@
 #include <linux/fsync_compat.h>
 #include <linux/xattr.h>
 #include <lzfs_xattr.h>
+#include <lzfs_inode.h>
+#include <lzfs_super.h>
+#include <lzfs_cred.h>
+#include <lzfs_opstat.h>
 
 #ifdef SS_DEBUG_SUBSYS
 #undef SS_DEBUG_SUBSYS
@@ -49,22 +63,150 @@ static int checkname(char *name)
 	}
 }
 
+/*
+ * A name was added to or removed from dir.  i_version is the directory's
+ * change generation, negative dentries remember the one they were made
+ * under.  Callers hold dir->i_mutex.
+ */
+static inline void lzfs_dir_changed(struct inode *dir)
+{
+	dir->i_version++;
+	lzfs_attr_invalidate(dir);
+}
+
+/*
+ * Positive dentries are kept in step by the namespace vnops themselves.
+ * A negative one stays valid, and a repeated probe of a missing name is
+ * a pure dcache hit, for as long as its parent's generation matches the
+ * one recorded when zfs_lookup came back with ENOENT.
+ */
+static int
+lzfs_d_revalidate(struct dentry *dentry, struct nameidata *nd)
+{
+	struct dentry *parent;
+	int valid;
+
+	if (dentry->d_inode)
+		return 1;
+
+	parent = dget_parent(dentry);
+	valid = parent->d_inode &&
+	    dentry->d_time == (unsigned long) parent->d_inode->i_version;
+	dput(parent);
+	return valid;
+}
+
+const struct dentry_operations lzfs_dentry_operations = {
+	.d_revalidate	= lzfs_d_revalidate,
+};
+
+/*
+ * How long an "attrcache" mount may answer stat from the cached kstat.
+ * Every path through lzfs that changes attributes invalidates it at once;
+ * the timeout only bounds fields zfs moves on its own, such as the block
+ * count once a txg has synced.
+ */
+static unsigned int lzfs_attrcache_ms = 1000;
+module_param(lzfs_attrcache_ms, uint, 0644);
+MODULE_PARM_DESC(lzfs_attrcache_ms, "Lifetime of cached getattr results (ms)");
+
+static int lzfs_attr_cached(struct inode *inode, struct kstat *stat)
+{
+	lzfs_inode_t *li = LZFS_ITOLI(inode);
+	int hit;
+
+	spin_lock(&li->li_stat_lock);
+	hit = li->li_stat_gen_cached == atomic_read(&li->li_stat_gen) &&
+	    time_before(jiffies, li->li_stat_time +
+	    msecs_to_jiffies(lzfs_attrcache_ms));
+	if (hit)
+		*stat = li->li_stat;
+	spin_unlock(&li->li_stat_lock);
+	return hit;
+}
+
+/*
+ * gen was sampled before zfs_getattr, a change racing with it leaves
+ * the cache invalid rather than caching what zfs returned.
+ */
+static void lzfs_attr_cache(struct inode *inode, struct kstat *stat, int gen)
+{
+	lzfs_inode_t *li = LZFS_ITOLI(inode);
+
+	spin_lock(&li->li_stat_lock);
+	li->li_stat = *stat;
+	li->li_stat_time = jiffies;
+	li->li_stat_gen_cached = gen;
+	spin_unlock(&li->li_stat_lock);
+}
+
+/*
+ * Hand the dirty pages of a regular file to zfs and wait for them,
+ * including any a concurrent writeback is still writing.
+ */
+static int
+lzfs_flush_dirty(struct inode *inode)
+{
+	struct address_space *mapping = inode->i_mapping;
+
+	if (!S_ISREG(inode->i_mode) ||
+	    (!mapping_tagged(mapping, PAGECACHE_TAG_DIRTY) &&
+	    !mapping_tagged(mapping, PAGECACHE_TAG_WRITEBACK)))
+		return 0;
+	return filemap_write_and_wait(mapping);
+}
+
+/*
+ * zfs has not seen the writes behind dirty "writeback" pages yet, so its
+ * mtime, ctime and blocks lag.  The in-core inode has the times, and
+ * the blocks are taken to be at least what i_size covers.
+ */
+static void
+lzfs_stat_dirty(struct inode *inode, struct kstat *stat)
+{
+	struct address_space *mapping = inode->i_mapping;
+
+	if (!S_ISREG(inode->i_mode) ||
+	    (!mapping_tagged(mapping, PAGECACHE_TAG_DIRTY) &&
+	    !mapping_tagged(mapping, PAGECACHE_TAG_WRITEBACK)))
+		return;
+	if (timespec_compare(&inode->i_mtime, &stat->mtime) > 0)
+		stat->mtime = inode->i_mtime;
+	if (timespec_compare(&inode->i_ctime, &stat->ctime) > 0)
+		stat->ctime = inode->i_ctime;
+	stat->blocks = max_t(u64, stat->blocks, (stat->size + 511) >> 9);
+}
+
 static int lzfs_vnop_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *stat)
 {
 	struct inode *inode = dentry->d_inode;
 	vnode_t *vnode = NULL;
 	vattr_t vap;
-	const struct cred *cred = get_current_cred();
+	cred_t *cred = LZFS_CRED();
+	int attrcache = lzfs_mnt_opt(inode, LZFS_MNT_ATTRCACHE);
+	int gen = 0;
 	int err;
+	LZFS_OPSTAT(inode, GETATTR);
 
-	SENTRY;
 	vnode = LZFS_ITOV(inode);
 
+	if (attrcache) {
+		if (lzfs_attr_cached(inode, stat)) {
+			stat->size = i_size_read(inode);
+			if (lzfs_mnt_opt(inode, LZFS_MNT_WRITEBACK))
+				lzfs_stat_dirty(inode, stat);
+			tsd_exit();
+			return 0;
+		}
+		gen = atomic_read(&LZFS_ITOLI(inode)->li_stat_gen);
+	}
+
+	/* a stray AT_XVATTR in va_mask would send zfs past the vattr_t */
+	bzero(&vap, sizeof(vap));
 	err = zfs_getattr(vnode, &vap, 0, (struct cred *) cred, NULL);
+	LZFS_OPSTAT_RC(-err);
 	if (err) {
-		put_cred(cred);
 		tsd_exit();
-		SEXIT;
 		return PTR_ERR(ERR_PTR(-err));
 	}
 
@@ -83,9 +225,11 @@ static int lzfs_vnop_getattr(struct vfsmount *mnt, struct dentry *dentry, struct
 	stat->blksize = (1 << inode->i_blkbits);
 	// stat->blksize   = vap.va_blocksize;
 	//stat->blocks    = stat->size >> inode->i_blkbits;
-	put_cred(cred);
+	if (attrcache)
+		lzfs_attr_cache(inode, stat, gen);
+	if (lzfs_mnt_opt(inode, LZFS_MNT_WRITEBACK))
+		lzfs_stat_dirty(inode, stat);
 	tsd_exit();
-	SEXIT;
 	return 0;
 }
 
@@ -95,46 +239,40 @@ lzfs_vnop_create(struct inode *dir, struct dentry *dentry, int mode,
 {
 	vnode_t *vp;
 	vnode_t *dvp;
-	vattr_t *vap;
-	const struct cred *cred = get_current_cred();
+	vattr_t vap;
+	cred_t *cred = LZFS_CRED();
 
 	int err, se_err;
+	LZFS_OPSTAT(dir, CREATE);
 
-	SENTRY;
 	err = checkname((char *)dentry->d_name.name);
 	if(err)
 		return -ENAMETOOLONG;
-	vap = kmalloc(sizeof(vattr_t), GFP_KERNEL);
-	ASSERT(vap != NULL);
-
-	memset(vap, 0, sizeof(vap));
+	bzero(&vap, sizeof(vap));
 
-	vap->va_type = IFTOVT(mode);
-	vap->va_mode = mode;
-	vap->va_mask = AT_TYPE|AT_MODE;
-	vap->va_uid = current_fsuid();
-	vap->va_gid = current_fsgid();
+	vap.va_type = IFTOVT(mode);
+	vap.va_mode = mode;
+	vap.va_mask = AT_TYPE|AT_MODE;
+	vap.va_uid = current_fsuid();
+	vap.va_gid = current_fsgid();
 
 	dvp = LZFS_ITOV(dir);
 
-	err = zfs_create(dvp, (char *)dentry->d_name.name, vap, 0, mode,
+	err = zfs_create(dvp, (char *)dentry->d_name.name, &vap, 0, mode,
 			 &vp, (struct cred *)cred, 0, NULL, NULL);
-	put_cred(cred);
-	kfree(vap);
+	LZFS_OPSTAT_RC(-err);
+	lzfs_dir_changed(dir);
 	if (err) {
 		tsd_exit();
-		SEXIT;
 		return PTR_ERR(ERR_PTR(-err));
 	}
 	d_instantiate(dentry, LZFS_VTOI(vp));
 	se_err = lzfs_init_security(dentry, dir);
 	if(se_err) {
 		tsd_exit();
-		SEXIT;
 		return se_err;
 	}
 	tsd_exit();
-	SEXIT;
 	return 0;
 }
 
@@ -142,24 +280,221 @@ lzfs_vnop_create(struct inode *dir, struct dentry *dentry, int mode,
  * 
  */
 
+/*
+ * Directory reads go through a batch of entries kept in the open file's
+ * private_data.  zfs_readdir has to rebuild and reposition its ZAP cursor
+ * from f_pos on every call, so each call reads LZFS_DIRBATCH entries
+ * ahead and the following getdents calls are served from the batch for
+ * as long as f_pos and the directory's i_version still match.
+ *
+ * On "readdirplus" mounts every child of a fresh batch is also looked up
+ * and given a hashed dentry, so the stat of each name that ls -l, du or
+ * rsync issue next is a dcache hit on an in core znode.
+ */
+#define LZFS_DIRBATCH		32
+/* name space of a batch, it has to fit in a page */
+#define LZFS_DIRBATCH_NAMES	3072
+
+typedef struct lzfs_dirent {
+	u64		ld_ino;
+	loff_t		ld_off;		/* this entry's cookie */
+	unsigned short	ld_type;
+	unsigned short	ld_namelen;
+	unsigned short	ld_name;	/* offset of the name in ldb_names */
+} lzfs_dirent_t;
+
+typedef struct lzfs_dirbatch {
+	int		ldb_n;		/* entries filled */
+	int		ldb_next;	/* first entry not yet returned */
+	int		ldb_eof;	/* batch ends the directory */
+	int		ldb_full;	/* an entry did not fit */
+	int		ldb_namelen;	/* bytes of ldb_names used */
+	loff_t		ldb_end;	/* cookie following the batch */
+	u64		ldb_version;	/* directory i_version at fill time */
+	lzfs_dirent_t	ldb_ent[LZFS_DIRBATCH];
+	char		ldb_names[LZFS_DIRBATCH_NAMES];
+} lzfs_dirbatch_t;
+
+#define LZFS_DIRENT_NAME(db, de)	((db)->ldb_names + (de)->ld_name)
+
+static int
+lzfs_dirbatch_fill(void *buf, const char *name, int namelen, loff_t offset,
+		u64 ino, unsigned type)
+{
+	lzfs_dirbatch_t *db = buf;
+	lzfs_dirent_t *de;
+
+	if (namelen >= MAXNAMELEN)
+		return -EINVAL;
+	/* looks like a full buffer, zfs_readdir stops at this entry */
+	if (db->ldb_n == LZFS_DIRBATCH ||
+	    db->ldb_namelen + namelen + 1 > LZFS_DIRBATCH_NAMES) {
+		db->ldb_full = 1;
+		return -EINVAL;
+	}
+
+	de = &db->ldb_ent[db->ldb_n++];
+	de->ld_ino     = ino;
+	de->ld_off     = offset;
+	de->ld_type    = type;
+	de->ld_namelen = namelen;
+	de->ld_name    = db->ldb_namelen;
+	memcpy(LZFS_DIRENT_NAME(db, de), name, namelen);
+	LZFS_DIRENT_NAME(db, de)[namelen] = '\0';
+	db->ldb_namelen += namelen + 1;
+	return 0;
+}
+
+/* the caller holds dir->i_mutex, as vfs_readdir does */
+static void
+lzfs_dirbatch_instantiate(struct dentry *parent, lzfs_dirbatch_t *db)
+{
+	vnode_t *dvp = LZFS_ITOV(parent->d_inode);
+	struct dentry *child, *alias;
+	struct qstr name;
+	vnode_t *vp;
+	int i;
+
+	for (i = 0; i < db->ldb_n; i++) {
+		lzfs_dirent_t *de = &db->ldb_ent[i];
+		char *dname = LZFS_DIRENT_NAME(db, de);
+
+		if (dname[0] == '.' && (de->ld_namelen == 1 ||
+		    (de->ld_namelen == 2 && dname[1] == '.')))
+			continue;
+
+		name.name = dname;
+		name.len  = de->ld_namelen;
+		name.hash = full_name_hash(name.name, name.len);
+
+		child = d_lookup(parent, &name);
+		if (child) {
+			dput(child);
+			continue;
+		}
+
+		if (zfs_lookup(dvp, dname, &vp, NULL, 0, NULL,
+		    LZFS_CRED(), NULL, NULL, NULL))
+			continue;
+
+		child = d_alloc(parent, &name);
+		if (!child) {
+			iput(LZFS_VTOI(vp));
+			continue;
+		}
+		child->d_op = &lzfs_dentry_operations;
+		alias = d_splice_alias(LZFS_VTOI(vp), child);
+		if (alias && !IS_ERR(alias))
+			dput(alias);
+		dput(child);
+	}
+}
+
+/* position of the entry after ldb_ent[i] */
+static inline loff_t
+lzfs_dirbatch_pos(lzfs_dirbatch_t *db, int i)
+{
+	return (i + 1 < db->ldb_n ? db->ldb_ent[i + 1].ld_off : db->ldb_end);
+}
+
+static int
+lzfs_dirbatch_valid(lzfs_dirbatch_t *db, struct inode *dir, loff_t pos)
+{
+	if (db->ldb_version != dir->i_version)
+		return 0;
+	if (db->ldb_next < db->ldb_n)
+		return (db->ldb_ent[db->ldb_next].ld_off == pos);
+	return (db->ldb_eof && db->ldb_end == pos);
+}
+
+static int
+lzfs_readdir_batched(struct file *filp, void *dirent, filldir_t filldir)
+{
+	struct dentry *dentry = filp->f_path.dentry;
+	struct inode *dir = dentry->d_inode;
+	lzfs_dirbatch_t *db = filp->private_data;
+	int eof, err;
+
+	BUILD_BUG_ON(sizeof (lzfs_dirbatch_t) > PAGE_SIZE);
+	if (!db) {
+		db = kmalloc(sizeof (lzfs_dirbatch_t), GFP_KERNEL);
+		/* no batch, read straight into the caller's buffer */
+		if (!db) {
+			err = zfs_readdir(LZFS_ITOV(dir), dirent, NULL, &eof,
+					NULL, 0, filldir, &filp->f_pos);
+			lzfs_attr_accessed(dir);
+			return err;
+		}
+		db->ldb_n = db->ldb_next = 0;
+		db->ldb_eof = 0;
+		db->ldb_version = dir->i_version - 1;
+		filp->private_data = db;
+	}
+
+	for (;;) {
+		if (!lzfs_dirbatch_valid(db, dir, filp->f_pos)) {
+			db->ldb_n = db->ldb_next = 0;
+			db->ldb_full = db->ldb_namelen = 0;
+			db->ldb_end = filp->f_pos;
+			db->ldb_version = dir->i_version;
+			err = zfs_readdir(LZFS_ITOV(dir), db, NULL, &eof, NULL,
+					0, lzfs_dirbatch_fill, &db->ldb_end);
+			/* zfs stamped the directory's atime */
+			lzfs_attr_accessed(dir);
+			if (err) {
+				db->ldb_version = dir->i_version - 1;
+				return err;
+			}
+			db->ldb_eof = !db->ldb_full;
+			if (lzfs_mnt_opt(dir, LZFS_MNT_READDIRPLUS))
+				lzfs_dirbatch_instantiate(dentry, db);
+		}
+
+		for (; db->ldb_next < db->ldb_n; db->ldb_next++) {
+			lzfs_dirent_t *de = &db->ldb_ent[db->ldb_next];
+
+			/* caller's buffer is full, resume at this entry */
+			if (filldir(dirent, LZFS_DIRENT_NAME(db, de),
+			    de->ld_namelen, de->ld_off, de->ld_ino,
+			    de->ld_type) < 0)
+				return 0;
+			filp->f_pos = lzfs_dirbatch_pos(db, db->ldb_next);
+		}
+		if (db->ldb_eof)
+			return 0;
+	}
+}
+
 int
 lzfs_vnop_readdir(struct file *filp, void *dirent, filldir_t filldir)
 {
 	vnode_t *vp;
 	int eof, err;
 	struct inode *inode = filp->f_path.dentry->d_inode;
+	LZFS_OPSTAT(inode, READDIR);
 
-	SENTRY;
 	vp = LZFS_ITOV(inode);
-	err = zfs_readdir(vp, dirent, NULL, &eof, NULL, 0, filldir, 
-			&filp->f_pos);
+	LZFS_OPSTAT_IO(filp->f_pos, 0);
+	if (S_ISDIR(inode->i_mode))
+		err = lzfs_readdir_batched(filp, dirent, filldir);
+	else {
+		err = zfs_readdir(vp, dirent, NULL, &eof, NULL, 0, filldir,
+				&filp->f_pos);
+		lzfs_attr_accessed(inode);
+	}
+	LZFS_OPSTAT_RC(-err);
 	tsd_exit();
-	SEXIT;
 	if (err)
 		return PTR_ERR(ERR_PTR(-err));
 	return 0;
 }
 
+static int
+lzfs_dir_release(struct inode *inode, struct file *filp)
+{
+	kfree(filp->private_data);
+	return 0;
+}
 
 static struct dentry *
 lzfs_vnop_lookup(struct inode * dir, struct dentry *dentry,
@@ -168,9 +503,9 @@ lzfs_vnop_lookup(struct inode * dir, struct dentry *dentry,
 	vnode_t *vp;
 	vnode_t *dvp;
 	int err;
-	const struct cred *cred = get_current_cred();
+	cred_t *cred = LZFS_CRED();
+	LZFS_OPSTAT(dir, LOOKUP);
 
-	SENTRY;
 	err = checkname((char *)dentry->d_name.name);
 	if(err)
 		return ((void * )-ENAMETOOLONG);
@@ -178,13 +513,14 @@ lzfs_vnop_lookup(struct inode * dir, struct dentry *dentry,
 
 	err = zfs_lookup(dvp, (char *)dentry->d_name.name, &vp, NULL, 0 , NULL, 
 			(struct cred *) cred, NULL, NULL, NULL);
-	put_cred(cred);
+	LZFS_OPSTAT_RC(-err);
 	tsd_exit();
-	SEXIT;
+	dentry->d_op = &lzfs_dentry_operations;
 	if (err) {
-		if (err == ENOENT)
+		if (err == ENOENT) {
+			dentry->d_time = (unsigned long) dir->i_version;
 			return d_splice_alias(NULL, dentry);	
-		else
+		} else
 			return ERR_PTR(-err);
 	}
 
@@ -204,10 +540,10 @@ lzfs_vnop_link (struct dentry *old_dentry, struct inode * dir,
 	vnode_t *svp;
 	struct inode *inode = old_dentry->d_inode;
 	char *name = (char *)dentry->d_name.name;
-	const struct cred *cred = get_current_cred();
+	cred_t *cred = LZFS_CRED();
 	int err;
+	LZFS_OPSTAT(dir, LINK);
 
-	SENTRY;
 	/* Linux Kernel enforces a limit on number of hardlinks to a file. 
 	 * struct kstat used in getattr uses unsigned int variable to store 
 	 * hardlink count. ZFS does not restrict the number of hardlinks, 
@@ -229,7 +565,9 @@ lzfs_vnop_link (struct dentry *old_dentry, struct inode * dir,
 	atomic_inc(&inode->i_count);
 
 	err = zfs_link(tdvp, svp, name, (struct cred *)cred, NULL, 0);
-	put_cred(cred);
+	LZFS_OPSTAT_RC(-err);
+	lzfs_dir_changed(dir);
+	lzfs_attr_invalidate(inode);
 	if (err) {
 
 		/* Decrement the link count and release the hold in error case.
@@ -240,13 +578,11 @@ lzfs_vnop_link (struct dentry *old_dentry, struct inode * dir,
 		 */
 		iput(inode);
 		tsd_exit();
-		SEXIT;
 		return PTR_ERR(ERR_PTR(-err));
 	}
 
 	d_instantiate(dentry, LZFS_VTOI(svp));
 	tsd_exit();
-	SEXIT;
 	return 0;
 }
 
@@ -254,16 +590,18 @@ static int
 lzfs_vnop_unlink(struct inode *dir, struct dentry *dentry)
 {
 	vnode_t *dvp;
-	const struct cred *cred = get_current_cred();
+	cred_t *cred = LZFS_CRED();
 	int err;
+	LZFS_OPSTAT(dir, UNLINK);
 
-	SENTRY;
 	dvp = LZFS_ITOV(dir);
 	err = zfs_remove(dvp, (char *)dentry->d_name.name, 
 			(struct cred *)cred, NULL, 0);
-	put_cred(cred);
+	LZFS_OPSTAT_RC(-err);
+	lzfs_dir_changed(dir);
+	if (dentry->d_inode)
+		lzfs_attr_invalidate(dentry->d_inode);
 	tsd_exit();
-	SEXIT;
 	if (err)
 		return PTR_ERR(ERR_PTR(-err));
 
@@ -279,43 +617,36 @@ lzfs_vnop_symlink (struct inode *dir, struct dentry *dentry,
 {
 	vnode_t *dvp;
 	vnode_t *vp;
-	vattr_t *vap;
-	const struct cred *cred = get_current_cred();
+	vattr_t vap;
+	cred_t *cred = LZFS_CRED();
 	int err, se_err;
-	SENTRY;
+	LZFS_OPSTAT(dir, SYMLINK);
 	err = checkname((char *)dentry->d_name.name);
 	if(err)
 		return ENAMETOOLONG;
-	vap = kmalloc(sizeof(vattr_t), GFP_KERNEL);
-
-	ASSERT(vap != NULL);
-
-	memset(vap, 0, sizeof(vap));
+	bzero(&vap, sizeof(vap));
 	dvp = LZFS_ITOV(dir);
-	vap->va_type = VLNK; 
-	vap->va_mode = (S_IRWXU | S_IRWXG | S_IRWXO);
-	vap->va_mask = AT_TYPE|AT_MODE;
-	vap->va_uid = cred->uid;
-	vap->va_gid = cred->gid;
+	vap.va_type = VLNK; 
+	vap.va_mode = (S_IRWXU | S_IRWXG | S_IRWXO);
+	vap.va_mask = AT_TYPE|AT_MODE;
+	vap.va_uid = cred->uid;
+	vap.va_gid = cred->gid;
 
-	err = zfs_symlink(dvp, (char *)dentry->d_name.name, vap, 
+	err = zfs_symlink(dvp, (char *)dentry->d_name.name, &vap, 
 			(char *)symname, (struct cred *)cred , NULL, 0, &vp);
-	kfree(vap);
-	put_cred(cred);
+	LZFS_OPSTAT_RC(-err);
+	lzfs_dir_changed(dir);
 	if (err) {
 		tsd_exit();
-		SEXIT;
 		return PTR_ERR(ERR_PTR(-err));
 	}
 	d_instantiate(dentry, LZFS_VTOI(vp));
 	se_err = lzfs_init_security(dentry, dir);
 	if(se_err) {
  		tsd_exit();
-		SEXIT;
 		return se_err;
 	}
 	tsd_exit();
-	SEXIT;
 	return 0;
 }
 
@@ -324,42 +655,37 @@ lzfs_vnop_mkdir(struct inode *dir, struct dentry *dentry, int mode)
 {
 	vnode_t *vp;
 	vnode_t *dvp;
-	vattr_t *vap;
-	const struct cred *cred = get_current_cred();
+	vattr_t vap;
+	cred_t *cred = LZFS_CRED();
 	int err, se_err;
-	SENTRY;
+	LZFS_OPSTAT(dir, MKDIR);
 	err = checkname((char *)dentry->d_name.name);
 	if(err)
 		return -ENAMETOOLONG;
-	vap = kmalloc(sizeof(vattr_t), GFP_KERNEL);
-	ASSERT(vap != NULL);
-	memset(vap, 0, sizeof(vap));
-	vap->va_type = VDIR; 
-	vap->va_mode = mode;
-	vap->va_mask = AT_TYPE|AT_MODE;
-	vap->va_uid = current_fsuid();
-	vap->va_gid = current_fsgid();
+	bzero(&vap, sizeof(vap));
+	vap.va_type = VDIR; 
+	vap.va_mode = mode;
+	vap.va_mask = AT_TYPE|AT_MODE;
+	vap.va_uid = current_fsuid();
+	vap.va_gid = current_fsgid();
 
 	dvp = LZFS_ITOV(dir);
-	err = zfs_mkdir(dvp, (char *)dentry->d_name.name, vap,
+	err = zfs_mkdir(dvp, (char *)dentry->d_name.name, &vap,
 			&vp, (struct cred *) cred, NULL, 0, NULL);
-	kfree(vap);
-	put_cred(cred);
+	LZFS_OPSTAT_RC(-err);
+	lzfs_dir_changed(dir);
 	if (err) {
 		tsd_exit();
-		SEXIT;
 		return PTR_ERR(ERR_PTR(-err));
 	}
 	d_instantiate(dentry, LZFS_VTOI(vp));
 	se_err = lzfs_init_security(dentry, dir);
 	if(se_err) {
 		tsd_exit();
-		SEXIT;
 		return se_err;
 	}
 
 	tsd_exit();
-	SEXIT;
 	return 0;
 }
 
@@ -367,16 +693,16 @@ static int
 lzfs_vnop_rmdir(struct inode * dir, struct dentry *dentry)
 {
     vnode_t *dvp;
-    const struct cred *cred = get_current_cred();
+    cred_t *cred = LZFS_CRED();
     int err;
+    LZFS_OPSTAT(dir, RMDIR);
 
-    SENTRY;
     dvp = LZFS_ITOV(dir);
     err = zfs_rmdir(dvp, (char *)dentry->d_name.name, NULL, 
             (struct cred *) cred, NULL, 0);
-    put_cred(cred);
+    LZFS_OPSTAT_RC(-err);
+    lzfs_dir_changed(dir);
 	tsd_exit();
-    SEXIT;
     if (err) 
     	return PTR_ERR(ERR_PTR(-err));
     return 0;
@@ -394,49 +720,38 @@ lzfs_vnop_mknod(struct inode * dir, struct dentry *dentry, int mode,
 {
 	vnode_t *vp;
 	vnode_t *dvp;
-	vattr_t *vap;
-	const struct cred *cred = get_current_cred();
+	vattr_t vap;
+	cred_t *cred = LZFS_CRED();
 
 	int err, se_err;
-	SENTRY;
-	vap = kmalloc(sizeof(vattr_t), GFP_KERNEL);
-	ASSERT(vap != NULL);
-
-	memset(vap, 0, sizeof(vap));
+	LZFS_OPSTAT(dir, MKNOD);
+	bzero(&vap, sizeof(vap));
 
-	vap->va_type = IFTOVT(mode); 
-	vap->va_mode = mode;
-	vap->va_mask = AT_TYPE|AT_MODE;
-	vap->va_rdev = rdev;
-	vap->va_uid = current_fsuid();
-	vap->va_gid = current_fsgid();
-
-/*
-	printk(KERN_ERR "vap->va_type is %x, vap.vamode is %x orig mode %x dev %u\n",
-	       vap->va_type, vap->va_mode, mode, vap->va_rdev);
-*/
+	vap.va_type = IFTOVT(mode); 
+	vap.va_mode = mode;
+	vap.va_mask = AT_TYPE|AT_MODE;
+	vap.va_rdev = rdev;
+	vap.va_uid = current_fsuid();
+	vap.va_gid = current_fsgid();
 
 	dvp = LZFS_ITOV(dir);
 
-	err = zfs_create(dvp, (char *)dentry->d_name.name, vap, 0, mode, 
+	err = zfs_create(dvp, (char *)dentry->d_name.name, &vap, 0, mode, 
 			 &vp, (struct cred *)cred, 0, NULL, NULL);
-	put_cred(cred);
-	kfree(vap);
+	LZFS_OPSTAT_RC(-err);
+	lzfs_dir_changed(dir);
 	if (err) {
 		tsd_exit();
-		SEXIT;
 		return PTR_ERR(ERR_PTR(-err));
 	}
 	d_instantiate(dentry, LZFS_VTOI(vp));
 	se_err = lzfs_init_security(dentry, dir);
 	if(se_err) {
 		tsd_exit();
-		SEXIT;
 		return se_err;
 	}
 
 	tsd_exit();
-	SEXIT;
 	return 0;
 }
 
@@ -446,16 +761,20 @@ lzfs_vnop_rename (struct inode * old_dir, struct dentry * old_dentry,
 {
 	vnode_t *sdvp = LZFS_ITOV(old_dir);
 	vnode_t *tdvp = LZFS_ITOV(new_dir);
-	const struct cred *cred = get_current_cred();
+	cred_t *cred = LZFS_CRED();
 	int err;
+	LZFS_OPSTAT(old_dir, RENAME);
 
-	SENTRY;
 	err = zfs_rename(sdvp, (char *)old_dentry->d_name.name, tdvp, 
 			(char *) new_dentry->d_name.name, (struct cred *)cred, 
 			NULL, 0);	
-	put_cred(cred);
+	LZFS_OPSTAT_RC(-err);
+	lzfs_dir_changed(old_dir);
+	lzfs_dir_changed(new_dir);
+	lzfs_attr_invalidate(old_dentry->d_inode);
+	if (new_dentry->d_inode)
+		lzfs_attr_invalidate(new_dentry->d_inode);
 	tsd_exit();
-	SEXIT;
 	if (err)
 		return PTR_ERR(ERR_PTR(-err));
 	return 0;
@@ -466,69 +785,78 @@ lzfs_vnop_setattr(struct dentry *dentry, struct iattr *iattr)
 {
 	struct inode *inode = dentry->d_inode;
 	vnode_t *vp = LZFS_ITOV(inode);
-	vattr_t *vap;
+	vattr_t vap;
 	int mask = iattr->ia_valid;
-	const struct cred *cred = get_current_cred();
+	cred_t *cred = LZFS_CRED();
 	int err;
+	LZFS_OPSTAT(inode, SETATTR);
 
-	SENTRY;
 	err = inode_change_ok(inode, iattr);
-	if(err)
-	    return err;
+	if (err) {
+		tsd_exit();
+		return err;
+	}
 
-	vap = kmalloc(sizeof(vattr_t), GFP_KERNEL);
-	ASSERT(vap != NULL);
+	/*
+	 * Written back after the setattr, "writeback" data would stamp an
+	 * explicit mtime with the time of the writeback, or land past a
+	 * new size.  Other changes leave the dirty pages alone.
+	 */
+	if (lzfs_mnt_opt(inode, LZFS_MNT_WRITEBACK) &&
+	    (mask & (ATTR_SIZE | ATTR_ATIME | ATTR_MTIME))) {
+		err = lzfs_flush_dirty(inode);
+		if (err) {
+			tsd_exit();
+			return err;
+		}
+	}
 
-	memset(vap, 0, sizeof(vap));
+	bzero(&vap, sizeof(vap));
 	if (mask & ATTR_MODE) {
-		vap->va_mask |= AT_MODE;
-		vap->va_mode = iattr->ia_mode;
+		vap.va_mask |= AT_MODE;
+		vap.va_mode = iattr->ia_mode;
 	}
 	if (mask & ATTR_UID) {
-		vap->va_mask |= AT_UID;
-		vap->va_uid = iattr->ia_uid;
+		vap.va_mask |= AT_UID;
+		vap.va_uid = iattr->ia_uid;
 	}
 	if (mask & ATTR_GID) {
-		vap->va_mask |= AT_GID;
-		vap->va_gid = iattr->ia_gid;
+		vap.va_mask |= AT_GID;
+		vap.va_gid = iattr->ia_gid;
 	}
-	vap->va_type = IFTOVT(inode->i_mode); 
-	vap->va_mask |= AT_TYPE;
+	vap.va_type = IFTOVT(inode->i_mode); 
+	vap.va_mask |= AT_TYPE;
 	if (mask & (ATTR_ATIME | ATTR_MTIME | ATTR_CTIME)) {
 		if (mask & ATTR_ATIME) {
-			vap->va_mask |= AT_ATIME;       
-			vap->va_atime = iattr->ia_atime;
+			vap.va_mask |= AT_ATIME;       
+			vap.va_atime = iattr->ia_atime;
 		}
 		if (mask & ATTR_MTIME) {
-			vap->va_mask |= AT_MTIME; 
-			vap->va_mtime = iattr->ia_mtime;
+			vap.va_mask |= AT_MTIME; 
+			vap.va_mtime = iattr->ia_mtime;
 		}
 		if (mask & ATTR_CTIME) {
-			vap->va_mask |= AT_CTIME;
-			vap->va_ctime = iattr->ia_ctime;
+			vap.va_mask |= AT_CTIME;
+			vap.va_ctime = iattr->ia_ctime;
 		}
 	}
 
 	if (mask & ATTR_SIZE) {
 		/* truncate the inode, znode */
-		vap->va_mask |= AT_SIZE;
-		vap->va_size = iattr->ia_size;
+		vap.va_mask |= AT_SIZE;
+		vap.va_size = iattr->ia_size;
 
 		err = vmtruncate(inode, iattr->ia_size);
 		if (err) {
-			kfree(vap);
-			put_cred(cred);
 			tsd_exit();
-			SEXIT;
 			return err;
 		}
 	}
 
-	err = zfs_setattr(vp, vap, 0, (struct cred *)cred, NULL);
-	kfree(vap);
-	put_cred(cred);
+	err = zfs_setattr(vp, &vap, 0, (struct cred *)cred, NULL);
+	LZFS_OPSTAT_RC(-err);
+	lzfs_attr_invalidate(inode);
 	tsd_exit();
-	SEXIT;
 	if (err)
 		return PTR_ERR(ERR_PTR(-err));
 	return 0;
@@ -537,6 +865,8 @@ lzfs_vnop_setattr(struct dentry *dentry, struct iattr *iattr)
 int
 lzfs_vnop_permission(struct inode *inode, int mask)
 {
+	LZFS_OPSTAT(inode, PERMISSION);
+
 	return generic_permission(inode, mask, NULL);
 }
 
@@ -553,19 +883,16 @@ static void *lzfs_follow_link(struct dentry *dentry, struct nameidata *nd)
 {
 	struct inode *inode = dentry->d_inode;
 	vnode_t *vp         = LZFS_ITOV(inode);
-	const struct cred *cred = get_current_cred();
+	cred_t *cred = LZFS_CRED();
 	size_t  len  = i_size_read(inode);
 	char    *buf = NULL;
 	struct iovec iov;
 	uio_t uio;
 	int err;
-
-	SENTRY;
+	LZFS_OPSTAT(inode, FOLLOW_LINK);
 
 	if (NULL == (buf = kzalloc(len + 1, GFP_KERNEL))) {
-		put_cred(cred);
 		tsd_exit();
-		SEXIT;
 		return ERR_PTR(-ENOMEM);
 	}
 
@@ -580,6 +907,7 @@ static void *lzfs_follow_link(struct dentry *dentry, struct nameidata *nd)
 	uio.uio_segflg = UIO_SYSSPACE;
 
 	err = zfs_readlink(vp, &uio, (struct cred *)cred, NULL);
+	LZFS_OPSTAT_RC(-err);
 	if (err) {
 		kfree(buf);
 		buf = ERR_PTR(-err);
@@ -587,58 +915,99 @@ static void *lzfs_follow_link(struct dentry *dentry, struct nameidata *nd)
 		buf[len] = '\0';
 
 	nd_set_link(nd, buf);
-	put_cred(cred);
 	tsd_exit();
-	SEXIT;
 	return NULL;
 }
 
-#if 0
+/* symbol exported by zfs module */
+extern int zfs_sync(vfs_t *vfsp, short flag, cred_t *cr);
+
+/* an fsync waiting for its batch to be committed, on the caller's stack */
+typedef struct lzfs_fsync_waiter {
+	struct list_head	lfw_list;
+	int			lfw_done;
+	int			lfw_err;
+} lzfs_fsync_waiter_t;
+
+/*
+ * fsync group commit, for mounts with fsync_window=usecs.  The first
+ * fsync to arrive leads a batch: it waits out the window, closes the
+ * batch and commits the whole ZIL of the dataset with zfs_sync, which
+ * covers every file whose fsync joined in the meantime.  Then it hands
+ * the result to all of them and wakes them together.  An fsync arriving
+ * while a batch is committed leads the next one, so commits overlap the
+ * window of the following batch.
+ */
 static int
-lzfs_vnop_readlink(struct dentry *dentry, char __user *buf, int len)
+lzfs_fsync_group(struct inode *inode, cred_t *cred)
 {
-	struct iovec iov = { .iov_base = buf, .iov_len = len};	
-	vnode_t *vp = LZFS_ITOV(dentry->d_inode);
-	const struct cred *cred = get_current_cred();
-	uio_t uio;
-	int err;
+	lzfs_sb_info_t *lsb = LZFS_SB(inode->i_sb);
+	lzfs_fsync_waiter_t self, *w, *next;
+	LIST_HEAD(batch);
+	ktime_t window;
+	int leader, err;
+
+	self.lfw_done = 0;
+	self.lfw_err  = 0;
+	spin_lock(&lsb->lsb_fsync_lock);
+	list_add_tail(&self.lfw_list, &lsb->lsb_fsync_batch);
+	leader = !lsb->lsb_fsync_leader;
+	lsb->lsb_fsync_leader = 1;
+	spin_unlock(&lsb->lsb_fsync_lock);
+
+	if (!leader) {
+		wait_event(lsb->lsb_fsync_wait, self.lfw_done);
+		return self.lfw_err;
+	}
 
-	SENTRY;
-	uio.uio_iov = &iov;
-	uio.uio_iovcnt = 1;
-	uio.uio_resid = len;
-	uio.uio_segflg = UIO_SYSSPACE;
+	window = ns_to_ktime((u64) lsb->lsb_fsync_window * NSEC_PER_USEC);
+	set_current_state(TASK_UNINTERRUPTIBLE);
+	schedule_hrtimeout(&window, HRTIMER_MODE_REL);
 
-//	printk("%s inode %ld\n", __FUNCTION__, dentry->d_inode->i_ino);
-	err = zfs_readlink(vp, &uio, (struct cred *)cred, NULL);
-	if (err)
-		return PTR_ERR(ERR_PTR(-err));
-	SEXIT;
-/*
-	printk("%s err %d ret %d\n", __FUNCTION__, err, 
-	       (int)(len - uio.uio_resid));
-*/
-	
-	return ((int) (len - uio.uio_resid));
+	spin_lock(&lsb->lsb_fsync_lock);
+	list_splice_init(&lsb->lsb_fsync_batch, &batch);
+	lsb->lsb_fsync_leader = 0;
+	spin_unlock(&lsb->lsb_fsync_lock);
+
+	err = zfs_sync(&lsb->lsb_vfs, 0, cred);
+
+	/* a waiter may return as soon as it sees lfw_done */
+	spin_lock(&lsb->lsb_fsync_lock);
+	list_for_each_entry_safe(w, next, &batch, lfw_list) {
+		list_del(&w->lfw_list);
+		w->lfw_err  = err;
+		w->lfw_done = 1;
+	}
+	spin_unlock(&lsb->lsb_fsync_lock);
+	wake_up_all(&lsb->lsb_fsync_wait);
+	return self.lfw_err;
 }
-#endif
+
 LZFS_VNOP_FSYNC_HANDLER(lzfs_vnop_fsync)
 {       
+	struct inode *inode = filep->f_path.dentry->d_inode;
 	int err = 0;
 	vnode_t *vp = NULL;
-	const struct cred *cred = get_current_cred();
-
-	SENTRY;
+	cred_t *cred = LZFS_CRED();
+	LZFS_OPSTAT(inode, FSYNC);
 
-	vp = LZFS_ITOV(filep->f_path.dentry->d_inode); 
-	err = zfs_fsync(vp, datasync, (struct cred *)cred, NULL);
+	vp = LZFS_ITOV(inode);
+	/* the VFS flushes the mapping first, nfsd and others may not */
+	err = -lzfs_flush_dirty(inode);
+	if (err)
+		goto out;
+	if (LZFS_SB(inode->i_sb)->lsb_fsync_window)
+		err = lzfs_fsync_group(inode, cred);
+	else
+		err = zfs_fsync(vp, datasync, (struct cred *)cred, NULL);
+out:
+	LZFS_OPSTAT_RC(-err);
 
-	put_cred(cred);
-	SEXIT;
-	return err;
+	tsd_exit();
+	return -err;
 }
 
-/* XXX --> Internal function used by lzfs_vnop_readlink and lzfs_readpage
+/* XXX --> Internal function used by lzfs_fill_page
  *
  * Performs the read operation
  *
@@ -667,220 +1036,325 @@ static inline ssize_t lzfs_read(vnode_t *vp, const char *buf, ssize_t len,
 		.uio_segflg   = segment,
 	};
 
-	const cred_t *cred = get_current_cred();
+	cred_t *cred = LZFS_CRED();
 
 	err = zfs_read(vp, &uio, 0, (cred_t *) cred, NULL);
-	put_cred(cred);
+	lzfs_attr_accessed(LZFS_VTOI(vp));
 	if (unlikely(err))
 		return -err;
 	return (len - uio.uio_resid);
 }
 
-int copy_data(read_descriptor_t *desc, struct page *page, 
-		unsigned long offset, unsigned long size)
+/*
+ * Send a read(2)/write(2) through the generic page cache path, the same
+ * way do_sync_read()/do_sync_write() would.  Used when the file system is
+ * mounted with the "pagecache" option.
+ */
+/*
+ * Reads served from the page cache never reach zfs_read, which is where
+ * zfs stamps atime: in core, written when the znode goes inactive, ctime
+ * untouched.  If the read moved the VFS atime, the vfsmount's noatime and
+ * relatime having had their say in touch_atime, have zfs stamp its own
+ * by reading back one byte of what was just read.  atime is the inode's
+ * i_atime from before the read.
+ */
+static void
+lzfs_pagecache_accessed(struct file *filep, struct timespec *atime,
+		loff_t pos, ssize_t done)
 {
-	char *kaddr;
-	unsigned long left, count = desc->count;
+	struct inode *inode = filep->f_mapping->host;
+	vnode_t *vp         = LZFS_ITOV(inode);
+	char c;
+	struct iovec iov = {
+		.iov_base = &c,
+		.iov_len  = 1,
+	};
+	uio_t uio = {
+		.uio_iov      = &iov,
+		.uio_iovcnt   = 1,
+		.uio_loffset  = (offset_t) pos,
+		.uio_resid    = 1,
+		.uio_segflg   = UIO_SYSSPACE,
+	};
 
-	if (size > count)
-		size = count;
+	if (done <= 0 || (filep->f_flags & O_DIRECT) ||
+	    !(vp->v_vfsp->vfs_flag & VFS_ATIME) ||
+	    timespec_equal(&inode->i_atime, atime))
+		return;
 
-	kaddr = kmap(page);
-	left  = copy_to_user(desc->arg.buf, kaddr + offset, size);
-	kunmap(page);
+	zfs_read(vp, &uio, 0, (cred_t *) LZFS_CRED(), NULL);
+	lzfs_attr_accessed(inode);
+}
+
+static ssize_t
+lzfs_pagecache_rw(struct file *filep, int rw, char __user *buf, size_t len,
+		loff_t *ppos)
+{
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len  = len,
+	};
+	struct timespec atime = filep->f_mapping->host->i_atime;
+	struct kiocb kiocb;
+	ssize_t ret;
 
-	if (left) {
-		size -= left;
-		desc->error = -EFAULT;
+	init_sync_kiocb(&kiocb, filep);
+	kiocb.ki_pos    = *ppos;
+	kiocb.ki_left   = len;
+	kiocb.ki_nbytes = len;
+
+	if (rw == READ)
+		ret = generic_file_aio_read(&kiocb, &iov, 1, kiocb.ki_pos);
+	else
+		ret = generic_file_aio_write(&kiocb, &iov, 1, kiocb.ki_pos);
+	if (ret == -EIOCBQUEUED)
+		ret = wait_on_sync_kiocb(&kiocb);
+	/* O_DIRECT is counted by lzfs_direct_IO */
+	if (rw == READ && !(filep->f_flags & O_DIRECT)) {
+		lzfs_io_account(filep->f_mapping->host->i_sb,
+				LZFS_IO_CACHE_READ, ret);
+		lzfs_pagecache_accessed(filep, &atime, *ppos, ret);
 	}
 
-	desc->count    = count - size;
-	desc->written += size;
-	desc->arg.buf += size;
-	return size;
+	*ppos = kiocb.ki_pos;
+	return ret;
 }
 
-ssize_t
-lzfs_vnop_read (struct file *filep, char __user *buf, size_t len, loff_t *ppos)
-{
-	vnode_t *vp = NULL;
-	loff_t isize;
-	ssize_t size;
+/*
+ * A uio over a private copy of the caller's iovecs.  uiomove advances
+ * both the iovecs and uio_iov as it goes, so neither may be the caller's.
+ * The caller's own iovecs stay untouched in lu_src.
+ */
+typedef struct lzfs_uio {
+	uio_t		lu_uio;
+	const struct iovec *lu_src;
+	unsigned long	lu_nr_segs;
+	struct iovec	*lu_iov;
+	struct iovec	lu_iovstack[UIO_FASTIOV];
+} lzfs_uio_t;
 
-	/* PAGE CACHE SUPPORT VARIABLES */
-	struct address_space *mapping = filep->f_mapping;
-	struct inode *inode = mapping->host;
-	struct file_ra_state *ra = &filep->f_ra;
-	pgoff_t index;
-	pgoff_t last_index;
-	pgoff_t prev_index;
-	unsigned long offset;      /* offset into pagecache page */
-	unsigned int prev_offset;
-	read_descriptor_t desc;
-
-	SENTRY;
-	vp  = LZFS_ITOV(inode);
-
-	if (likely(!(vp->v_flag & VMMAPPED))) {
-		/* file is not memory mmapped, pass read directly to ZFS */
-		ssize_t rc;
-		rc = lzfs_read(vp, buf, len, *ppos, UIO_USERSPACE);
-		if (likely(rc > 0))
-			*ppos += rc;
-		tsd_exit();
-		SEXIT;
-		return rc;
+static int
+lzfs_uio_init(lzfs_uio_t *lu, const struct iovec *iov, unsigned long nr_segs,
+		size_t len, loff_t pos, uio_seg_t segment)
+{
+	lu->lu_iov = lu->lu_iovstack;
+	if (nr_segs > UIO_FASTIOV) {
+		lu->lu_iov = kmalloc(nr_segs * sizeof (struct iovec),
+				GFP_KERNEL);
+		if (!lu->lu_iov)
+			return -ENOMEM;
 	}
+	memcpy(lu->lu_iov, iov, nr_segs * sizeof (struct iovec));
+	lu->lu_src      = iov;
+	lu->lu_nr_segs  = nr_segs;
+
+	bzero(&lu->lu_uio, sizeof(uio_t));
+	lu->lu_uio.uio_iov     = lu->lu_iov;
+	lu->lu_uio.uio_iovcnt  = nr_segs;
+	lu->lu_uio.uio_loffset = (offset_t) pos;
+	lu->lu_uio.uio_resid   = len;
+	lu->lu_uio.uio_limit   = MAXOFFSET_T;
+	lu->lu_uio.uio_segflg  = segment;
+	return 0;
+}
 
-	desc.written = 0;
-	desc.arg.buf = buf;
-	desc.count   = len;
-	desc.error   = 0;
+static void
+lzfs_uio_fini(lzfs_uio_t *lu)
+{
+	if (lu->lu_iov != lu->lu_iovstack)
+		kfree(lu->lu_iov);
+}
 
-	index = *ppos >> PAGE_CACHE_SHIFT;
-	prev_index = ra->prev_pos >> PAGE_CACHE_SHIFT;
-	prev_offset = ra->prev_pos & (PAGE_CACHE_SIZE - 1);
-	last_index = (*ppos + len + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
-	offset = *ppos & ~PAGE_CACHE_MASK;
+/*
+ * Copy bytes from the iterator into a locked page.  User memory is copied
+ * with page faults disabled, so a short count means the source was not
+ * resident.  Kernel buffers cannot fault.
+ */
+static size_t
+lzfs_copy_to_page(struct page *page, unsigned long offset, struct iov_iter *i,
+		size_t bytes, uio_seg_t segment)
+{
+	const struct iovec *iov = i->iov;
+	size_t base = i->iov_offset;
+	size_t copied, n;
+	char *kaddr;
 
-	while (1) {
-		struct page *page;
-		pgoff_t end_index;
-		unsigned long nr, ret;
+	if (segment == UIO_USERSPACE)
+		return iov_iter_copy_from_user_atomic(page, i, offset, bytes);
 
-#if 0
-		printk(KERN_INFO "desc.count=%ld, len=%ld, offset=%ld, pos=%lld\n", 
-				desc.count, len, offset, *ppos);
-#endif
+	kaddr = kmap_atomic(page, KM_USER0);
+	for (copied = 0; copied < bytes; copied += n, iov++, base = 0) {
+		n = min(bytes - copied, iov->iov_len - base);
+		memcpy(kaddr + offset + copied,
+				(char *) iov->iov_base + base, n);
+	}
+	kunmap_atomic(kaddr, KM_USER0);
+	return copied;
+}
 
-		if (!desc.count)
+/*
+ * zfs_write went around the page cache, bring any cached copies of the
+ * written range up to date from the data just written, as iov holds it.
+ * Only the written bytes are copied, so dirty mmap stores elsewhere in
+ * the page survive.  The source is faulted in before the page is locked;
+ * a page it still could not be copied into is invalidated instead.
+ */
+static void
+lzfs_update_pages(struct inode *inode, loff_t pos, size_t len,
+		const struct iovec *iov, unsigned long nr_segs, uio_seg_t segment)
+{
+	struct address_space *mapping = inode->i_mapping;
+	pgoff_t index = pos >> PAGE_CACHE_SHIFT;
+	pgoff_t end   = (pos + len - 1) >> PAGE_CACHE_SHIFT;
+	pgoff_t stale_start, stale_end;
+	struct pagevec pvec;
+	struct iov_iter from;
+	loff_t from_pos = pos;
+	int nr, i;
+
+	iov_iter_init(&from, iov, nr_segs, len, 0);
+	pagevec_init(&pvec, 0);
+	while (index <= end) {
+		nr = pagevec_lookup(&pvec, mapping, index,
+				min(end - index, (pgoff_t) PAGEVEC_SIZE - 1) + 1);
+		if (nr == 0)
 			break;
 
-		BUG_ON(desc.written > len);
-
-		cond_resched();
-		page = find_get_page(mapping, index);
-		if (!page) {
-			/* NORMAL CASE: DATA IS NOT CACHED */
-			goto no_cached_page;
-		}
-
-		/* MMAPED DATA: DATA IS CACHED */
-		if (!PageUptodate(page)) {
-			/* WE ARE USING PAGE CACHE ONLY FOR MMAP, ONCE WE GET 
-			 * LOCKED PAGE IT HAS TO BE UPTODATE */
+		stale_start = end + 1;
+		stale_end = 0;
+		for (i = 0; i < nr; i++) {
+			struct page *page = pvec.pages[i];
+			loff_t start = page_offset(page);
+			loff_t stop  = start + PAGE_CACHE_SIZE;
+			size_t bytes;
+
+			index = page->index + 1;
+			if (page->index > end)
+				break;
+
+			if (start < pos)
+				start = pos;
+			if (stop > pos + len)
+				stop = pos + len;
+			bytes = stop - start;
+
+			iov_iter_advance(&from, start - from_pos);
+			from_pos = start;
+			if (segment == UIO_USERSPACE)
+				iov_iter_fault_in_readable(&from, bytes);
 
 			lock_page(page);
-
-			if (!page->mapping) {
-				/* truncate happened */
-				unlock_page(page);
-				page_cache_release(page);
-				continue;
-			}
-
-			if (!PageUptodate(page)) {
-				unlock_page(page);
-				BUG();
+			if (page->mapping == mapping && PageUptodate(page)) {
+				if (mapping_writably_mapped(mapping))
+					flush_dcache_page(page);
+				if (lzfs_copy_to_page(page,
+				    start & ~PAGE_CACHE_MASK, &from, bytes,
+				    segment) != bytes) {
+					stale_start = min(stale_start,
+							page->index);
+					stale_end = page->index;
+				}
+				flush_dcache_page(page);
 			}
 			unlock_page(page);
 		}
-		isize = i_size_read(inode);
-		end_index = (isize - 1) >> PAGE_CACHE_SHIFT;
-		if (unlikely(!isize || index > end_index)) {
-			page_cache_release(page);
-			goto out;
-		}
-		/* nr is the maximum number of bytes to copy from this page */
-		nr = PAGE_CACHE_SIZE;
-		if (index == end_index) {
-			nr = ((isize - 1) & ~PAGE_CACHE_MASK) + 1;
-			if (nr <= offset) {
-				page_cache_release(page);
-				goto out;
-			}
-		}
-		nr = nr - offset;
-
-        if (mapping_writably_mapped(mapping))
-			flush_dcache_page(page);
-
-		mark_page_accessed(page);
-		prev_index = index;
-
-		ret = copy_data(&desc, page, offset, nr);
-		*ppos += ret;
-		offset += ret;
-		index  += (offset >> PAGE_CACHE_SHIFT);
-		offset &= ~PAGE_CACHE_MASK;
-		prev_offset = offset;
-
-		page_cache_release(page);
-
-#if 0
-		printk(KERN_ERR "%s: isize=%lld nr=%ld len=%ld offset=%ld desc.written=%ld desc.count=%ld pos=%lld.\n", 
-				__FUNCTION__, isize, nr, len, offset, desc.written, desc.count, *ppos);
-#endif
-
-		if (*ppos >= isize) {
-			ra->prev_pos = prev_index;
-			ra->prev_pos <<= PAGE_CACHE_SHIFT;
-			ra->prev_pos |= prev_offset;
-			goto out;
-		}
-
-		if (ret == nr && desc.count)
-			continue;
-
-		goto out;
-no_cached_page:
-		isize = i_size_read(inode);
-		if (*ppos >= isize)
-			break;
-		
-		size = PAGE_CACHE_SIZE;
-		if (desc.written + size > len)
-			size = len - desc.written;
+		pagevec_release(&pvec);
+		if (stale_start <= stale_end)
+			invalidate_inode_pages2_range(mapping, stale_start,
+					stale_end);
+		cond_resched();
+	}
+}
 
-		if (offset + size > isize)
-			size = isize - desc.written;
+/*
+ * Read or write without the page cache: every iovec goes to zfs in a
+ * single uio, so a writev costs one transaction however many segments
+ * it has.  *ppos is moved to the end of the transfer, which for O_APPEND
+ * writes is wherever zfs_write put the data.
+ */
+static ssize_t
+lzfs_rw_uio(struct file *filep, int rw, lzfs_uio_t *lu, const cred_t *cred,
+		loff_t *ppos)
+{
+	struct address_space *mapping = filep->f_mapping;
+	struct inode *inode = mapping->host;
+	vnode_t *vp  = LZFS_ITOV(inode);
+	uio_t *uio   = &lu->lu_uio;
+	ssize_t len  = uio->uio_resid;
+	ssize_t done;
+	int err;
 
-		ret = lzfs_read(vp, desc.arg.buf, size, *ppos, UIO_USERSPACE);
-		if (unlikely(ret < 0)) {
-			tsd_exit();
-			SEXIT;
-			return ret;
+	if (rw == READ) {
+		/* mmap stores live in the page cache until written back */
+		if (mapping_tagged(mapping, PAGECACHE_TAG_DIRTY)) {
+			err = filemap_write_and_wait_range(mapping,
+					uio->uio_loffset,
+					uio->uio_loffset + len - 1);
+			if (err)
+				return err;
 		}
+		err = zfs_read(vp, uio, 0, (cred_t *) cred, NULL);
+		lzfs_attr_accessed(inode);
+	} else {
+		err = zfs_write(vp, uio, filep->f_flags, (cred_t *) cred, NULL);
+		lzfs_attr_invalidate(inode);
+	}
 
-		desc.count    = desc.count - ret;
-		desc.written += ret;
-		desc.arg.buf += ret;
-		BUG_ON(desc.count < 0);
-
-		*ppos += ret;
-		index  += (offset >> PAGE_CACHE_SHIFT);
-		offset = *ppos & ~PAGE_CACHE_MASK;
-		prev_offset = offset;
-
-#if 0
-		printk(KERN_ERR "%s: isize=%lld size=%ld len=%ld offset=%ld written=%ld pos=%lld.\n", 
-				__FUNCTION__, isize, size, len, offset, desc.written, *ppos);
-#endif
-
-		if (!desc.count)
-			break; // goto out;
+	done = len - uio->uio_resid;
+	if (rw == READ) {
+		lzfs_io_account(inode->i_sb, LZFS_IO_READ, done);
+		task_io_account_read(done);
+	} else {
+		lzfs_io_account(inode->i_sb, LZFS_IO_WRITE, done);
+		task_io_account_write(done);
 	}
+	if (unlikely(err) && !done)
+		return -err;
 
-out:
-//	*ppos = ((loff_t)index << PAGE_CACHE_SHIFT) + offset;
-	zfs_file_accessed(vp);
-	tsd_exit();
-	SEXIT;
-	return ((ssize_t) (desc.written));
+	*ppos = uio->uio_loffset;
+	if (rw == WRITE && done && mapping->nrpages)
+		lzfs_update_pages(inode, uio->uio_loffset - done, done,
+				lu->lu_src, lu->lu_nr_segs, uio->uio_segflg);
+	return done;
 }
 
-/* XXX --> Internal function used by lzfs_vnop_write and lzfs_writepage 
- *
+ssize_t
+lzfs_vnop_read (struct file *filep, char __user *buf, size_t len, loff_t *ppos)
+{
+	struct inode *inode = filep->f_mapping->host;
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len  = len,
+	};
+	cred_t *cred;
+	lzfs_uio_t lu;
+	ssize_t rc;
+	LZFS_OPSTAT(inode, READ);
+	LZFS_OPSTAT_IO(*ppos, len);
+
+	/*
+	 * O_DIRECT also goes the generic way, it flushes dirty mmap pages
+	 * of the range before handing it to lzfs_direct_IO.
+	 */
+	if (lzfs_mnt_opt(inode, LZFS_MNT_PAGECACHE) ||
+	    (filep->f_flags & O_DIRECT)) {
+		rc = lzfs_pagecache_rw(filep, READ, buf, len, ppos);
+		goto out;
+	}
+
+	rc = lzfs_uio_init(&lu, &iov, 1, len, *ppos, UIO_USERSPACE);
+	if (rc)
+		goto out;
+	cred = LZFS_CRED();
+	rc = lzfs_rw_uio(filep, READ, &lu, cred, ppos);
+	lzfs_uio_fini(&lu);
+out:
+	LZFS_OPSTAT_RC(rc);
+	tsd_exit();
+	return rc;
+}
+/* XXX --> Internal function used by lzfs_write_end
+ *
  * Performs the write operation
  *
  * Explanation of parameters
@@ -910,10 +1384,10 @@ static inline ssize_t lzfs_write(vnode_t *vp, unsigned int file_flags,
 		.uio_segflg  = segment,
 	};
 
-	const cred_t *cred = get_current_cred();
+	cred_t *cred = LZFS_CRED();
 
 	err = zfs_write(vp, &uio, file_flags, (cred_t *)cred, NULL);
-	put_cred(cred);
+	lzfs_attr_invalidate(LZFS_VTOI(vp));
 	if (unlikely(err))
 		return -err;
 	return (len - uio.uio_resid);
@@ -923,125 +1397,48 @@ ssize_t
 lzfs_vnop_write (struct file *filep, const char __user *buf, size_t len, 
 		 loff_t *ppos)
 {
-	vnode_t *vp = NULL;
+	struct inode *inode = filep->f_mapping->host;
+	struct iovec iov = {
+		.iov_base = (char __user *) buf,
+		.iov_len  = len,
+	};
+	cred_t *cred;
+	lzfs_uio_t lu;
 	ssize_t rc;
+	LZFS_OPSTAT(inode, WRITE);
+	LZFS_OPSTAT_IO(*ppos, len);
 
-	/* PAGE CACHE SUPPORT VARIABLES */
-	struct address_space *mapping = filep->f_mapping;
-	struct inode *inode = mapping->host;
-	pgoff_t index;
-	unsigned long written;
-	unsigned long offset;
-
-	const char *user_buf = buf;
-
-	loff_t pos_append;
-
-	SENTRY;
-	vp = LZFS_ITOV(inode);
-
-	rc = lzfs_write(vp, filep->f_flags, buf, len, *ppos, UIO_USERSPACE);
-	if (unlikely(rc < 0)) {
-		tsd_exit();
-		SEXIT;
-		return rc;
-	}
-	pos_append = *ppos;
-	*ppos += rc;
-	
-	if (likely(!(vp->v_flag & VMMAPPED))) {
-		/* file is not memory mmapped, pass write directly to ZFS */
-		tsd_exit();
-		SEXIT;
-		return rc;
-	}
-
-	index = pos_append >> PAGE_CACHE_SHIFT;
-	offset = pos_append & ~PAGE_CACHE_MASK;
-	written = 0;
-
-	while (1) {
-		struct page *page = NULL;
-		char *page_buf;
-		ssize_t size;
-		ssize_t tmp;
-
-		if (written >= len)
-			break;
-
-		size = PAGE_CACHE_SIZE - offset;
-		if (written + size > len) {
-			size = len - written;
-		}
-
-		page = find_lock_page(mapping, index);
-		if (likely(!page)) {
-#if 0
-			printk ("%s: Page not cached. ppos=%llu, pos_append=%llu, offset=%ld, "
-					"len=%ld, size=%ld\n", __FUNCTION__, *ppos, pos_append, offset, 
-					len, size);
-#endif
-			goto no_cached_page;
-		}
-#if 0
-		printk ("%s: Page cached. ppos=%llu, pos_append=%llu, offset=%ld, len=%ld, "
-				"size=%ld\n", __FUNCTION__, *ppos, pos_append, offset, len, size);
-#endif
-
-		if (mapping_writably_mapped(mapping))
-			flush_dcache_page(page);
-
-//		pagefault_disable();
-
-		/* copy the data */
-//		BUG_ON(!in_atomic());
-		page_buf = kmap_atomic(page, KM_USER0);
-		tmp = __copy_from_user_inatomic(page_buf + offset, user_buf, size);
-		kunmap_atomic(page_buf, KM_USER0);
-//		pagefault_enable();
-		flush_dcache_page(page);
-		if (tmp) {
-			unlock_page(page);
-			tsd_exit();
-			SEXIT;
-			return -EFAULT;
-		}
-
-		mark_page_accessed(page);
-
-		SetPageUptodate(page);
-		ClearPageError(page);
-//		set_page_dirty(page);
-		/* data is written to disk and then a page is modified 
-		   i.e. page is not dirty */
-//		page_clear_dirty(page);
-		unlock_page(page);
-		page_cache_release(page);
-//		zfs_file_modified(vp);
-
-//		balance_dirty_pages_ratelimited(mapping);
-
-no_cached_page:
-		user_buf += size;
-		written  += size;
-		pos_append += size;
-		index    =  pos_append >> PAGE_CACHE_SHIFT;
-		offset   =  0;
+	/*
+	 * O_DIRECT also goes the generic way, it writes back and invalidates
+	 * cached pages of the range around lzfs_direct_IO.
+	 */
+	if (lzfs_mnt_opt(inode, LZFS_MNT_PAGECACHE) ||
+	    (filep->f_flags & O_DIRECT)) {
+		rc = lzfs_pagecache_rw(filep, WRITE, (char __user *)buf, len,
+				ppos);
+		goto out;
 	}
 
+	rc = lzfs_uio_init(&lu, &iov, 1, len, *ppos, UIO_USERSPACE);
+	if (rc)
+		goto out;
+	cred = LZFS_CRED();
+	rc = lzfs_rw_uio(filep, WRITE, &lu, cred, ppos);
+	lzfs_uio_fini(&lu);
+out:
+	LZFS_OPSTAT_RC(rc);
 	tsd_exit();
-	SEXIT;
 	return rc;
 }
-
-/* 
- * fops->open is not needed for default operations, but in case mmap is 
- * called on an opened file we need strcut file *, save it in vnode_t
- * */
+/*
+ * lzfs itself never looks at vp->v_file, writeback and page_mkwrite work
+ * from the mapping alone.  It is still saved for other vnode users.
+ */
 static int lzfs_vnop_open(struct inode *inode, struct file *file)
 {
 	vnode_t *vp = NULL;
 	int rc;
+	LZFS_OPSTAT(inode, OPEN);
 
 	if ((rc = generic_file_open(inode, file)) < 0)
 		goto out;
@@ -1052,6 +1449,7 @@ static int lzfs_vnop_open(struct inode *inode, struct file *file)
 	vp->v_file = file;
 	mutex_exit(&vp->v_lock);
 out:
+	LZFS_OPSTAT_RC(rc);
 	return rc;
 }
 
@@ -1061,15 +1459,110 @@ const struct inode_operations zfs_symlink_inode_operations = {
     .put_link       = lzfs_put_link,
 };
 
+/* symbol exported by zfs module */
+extern int zfs_statvfs(vfs_t *vfsp, struct statvfs64 *statp);
+
+/*
+ * Whether the pool has room for len more bytes of the file, asked by
+ * fallocate and before data is left dirty in the page cache, as
+ * writeback has nobody to return ENOSPC to.  ZFS is copy on write, so
+ * there is nothing to reserve, this is a best effort check.  Returns 0
+ * or a zfs errno.
+ *
+ * write_begin asks for every clean page, so the answer comes from a per
+ * mount estimate that each check takes its len off.  zfs_statvfs is only
+ * called once the estimate is older than LZFS_SPACE_TTL or would drop
+ * below LZFS_SPACE_MARGIN, and ENOSPC is only ever decided on fresh
+ * numbers.
+ */
+static int
+lzfs_space_check(struct inode *inode, loff_t len)
+{
+	lzfs_sb_info_t *lsb = LZFS_SB(inode->i_sb);
+	struct statvfs64 stat;
+	loff_t avail;
+	int err;
+
+	spin_lock(&lsb->lsb_space_lock);
+	if (time_before(jiffies, lsb->lsb_space_time + LZFS_SPACE_TTL) &&
+	    lsb->lsb_space_avail - len >= LZFS_SPACE_MARGIN) {
+		lsb->lsb_space_avail -= len;
+		spin_unlock(&lsb->lsb_space_lock);
+		return 0;
+	}
+	spin_unlock(&lsb->lsb_space_lock);
+
+	err = zfs_statvfs(LZFS_ITOV(inode)->v_vfsp, &stat);
+	if (err)
+		return err;
+	avail = stat.f_bavail * stat.f_frsize;
+	if (len > avail)
+		return ENOSPC;
+
+	spin_lock(&lsb->lsb_space_lock);
+	lsb->lsb_space_avail = avail - len;
+	lsb->lsb_space_time  = jiffies;
+	spin_unlock(&lsb->lsb_space_lock);
+	return 0;
+}
+
+/*
+ * First store to a clean page of a shared writable mapping.  The page is
+ * refused if truncate took it away or the pool has no room left for it,
+ * a SIGBUS now being better than data writeback has to drop later.  A
+ * page still under writeback is waited for, so zfs never copies a page
+ * changing beneath it.  The dirty tag set here is the per page record of
+ * what changed, writepages and fsync push only tagged pages.
+ */
+static int
+lzfs_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct page *page   = vmf->page;
+	struct inode *inode = vma->vm_file->f_mapping->host;
+	int ret             = VM_FAULT_LOCKED;
+	LZFS_OPSTAT(inode, PAGE_MKWRITE);
+
+	LZFS_OPSTAT_IO(page_offset(page), PAGE_CACHE_SIZE);
+	lock_page(page);
+	if (page->mapping != inode->i_mapping ||
+	    page_offset(page) >= i_size_read(inode)) {
+		/* truncated since the fault, the retry finds out */
+		ret = VM_FAULT_NOPAGE;
+		goto out;
+	}
+
+	if (lzfs_space_check(inode, PAGE_CACHE_SIZE)) {
+		ret = VM_FAULT_SIGBUS;
+		goto out;
+	}
+
+	wait_on_page_writeback(page);
+	set_page_dirty(page);
+out:
+	if (ret != VM_FAULT_LOCKED)
+		unlock_page(page);
+	LZFS_OPSTAT_RC(ret);
+	tsd_exit();
+	return ret;
+}
+
+static const struct vm_operations_struct lzfs_vm_ops = {
+	.fault		= filemap_fault,
+	.page_mkwrite	= lzfs_page_mkwrite,
+};
+
 int lzfs_file_mmap(struct file * file, struct vm_area_struct * vma)
 {
 	struct address_space *mapping = file->f_mapping;
 	vnode_t *vp = LZFS_ITOV(mapping->host);
 	int rc;
+	LZFS_OPSTAT(mapping->host, MMAP);
 
 	rc = generic_file_mmap(file, vma);
+	LZFS_OPSTAT_RC(rc);
 	if (rc < 0)
 		return rc;
+	vma->vm_ops = &lzfs_vm_ops;
 
 	mutex_enter(&vp->v_lock);
 	vp->v_flag |= VMMAPPED;
@@ -1077,111 +1570,393 @@ int lzfs_file_mmap(struct file * file, struct vm_area_struct * vma)
 	return rc;
 }
 
+/*
+ * An io_submit request handed to the aio worker pool.
+ */
+typedef struct lzfs_aio {
+	struct kiocb		*la_iocb;
+	int			la_rw;
+	const struct cred	*la_cred;
+	lzfs_uio_t		la_uio;
+} lzfs_aio_t;
+
+static void lzfs_aio_task(void *arg)
+{
+	lzfs_aio_t *la      = arg;
+	struct kiocb *iocb  = la->la_iocb;
+	struct mm_struct *mm = iocb->ki_ctx->mm;
+	ssize_t rc;
+
+	/* the iovecs point into the submitter's address space */
+	use_mm(mm);
+	rc = lzfs_rw_uio(iocb->ki_filp, la->la_rw, &la->la_uio,
+			la->la_cred, &iocb->ki_pos);
+	unuse_mm(mm);
+
+	put_cred(la->la_cred);
+	lzfs_uio_fini(&la->la_uio);
+	kfree(la);
+	tsd_exit();
+	aio_complete(iocb, rc, 0);
+}
+
+static ssize_t
+lzfs_aio_rw(struct kiocb *iocb, int rw, const struct iovec *iov,
+		unsigned long nr_segs, loff_t pos)
+{
+	struct file *filep  = iocb->ki_filp;
+	struct inode *inode = filep->f_mapping->host;
+	size_t count        = 0;
+	cred_t *cred;
+	lzfs_aio_t *la;
+	lzfs_uio_t lu;
+	ssize_t rc;
+
+	if (lzfs_mnt_opt(inode, LZFS_MNT_PAGECACHE) ||
+	    (filep->f_flags & O_DIRECT)) {
+		struct timespec atime = inode->i_atime;
+
+		if (rw == WRITE)
+			return generic_file_aio_write(iocb, iov, nr_segs, pos);
+		rc = generic_file_aio_read(iocb, iov, nr_segs, pos);
+		if (!(filep->f_flags & O_DIRECT)) {
+			lzfs_io_account(inode->i_sb, LZFS_IO_CACHE_READ, rc);
+			lzfs_pagecache_accessed(filep, &atime, pos, rc);
+		}
+		return rc;
+	}
+
+	rc = generic_segment_checks(iov, &nr_segs, &count,
+			rw == READ ? VERIFY_WRITE : VERIFY_READ);
+	if (rc || count == 0)
+		return rc;
+
+	if (!is_sync_kiocb(iocb)) {
+		la = kmalloc(sizeof (lzfs_aio_t), GFP_KERNEL);
+		if (la && lzfs_uio_init(&la->la_uio, iov, nr_segs, count, pos,
+		    UIO_USERSPACE)) {
+			kfree(la);
+			la = NULL;
+		}
+		if (la) {
+			la->la_iocb = iocb;
+			la->la_rw   = rw;
+			la->la_cred = get_current_cred();
+			if (taskq_dispatch(lzfs_aio_taskq,
+			    lzfs_aio_task, la, TQ_SLEEP))
+				return -EIOCBQUEUED;
+			put_cred(la->la_cred);
+			lzfs_uio_fini(&la->la_uio);
+			kfree(la);
+		}
+		/* no worker, complete it in the submitter instead */
+	}
+
+	rc = lzfs_uio_init(&lu, iov, nr_segs, count, pos, UIO_USERSPACE);
+	if (rc)
+		return rc;
+	cred = LZFS_CRED();
+	rc = lzfs_rw_uio(filep, rw, &lu, cred, &iocb->ki_pos);
+	lzfs_uio_fini(&lu);
+	return rc;
+}
+
 ssize_t
 lzfs_vnop_aio_read(struct kiocb *iocb, const struct iovec *iov,
                 unsigned long nr_segs, loff_t pos)
 {
 	ssize_t result;
+	LZFS_OPSTAT(iocb->ki_filp->f_mapping->host, AIO_READ);
 
-	SENTRY;
-	result = generic_file_aio_read(iocb, iov, nr_segs, pos);
+	LZFS_OPSTAT_IO(pos, iov_length(iov, nr_segs));
+	result = lzfs_aio_rw(iocb, READ, iov, nr_segs, pos);
+	LZFS_OPSTAT_RC(result);
 	tsd_exit();
-	SEXIT;
 	return result;
 }
 
-static ssize_t lzfs_perform_write(struct file *file,
-                                struct iov_iter *i, loff_t pos)
+ssize_t
+lzfs_vnop_aio_write(struct kiocb *iocb, const struct iovec *iov,
+                unsigned long nr_segs, loff_t pos)
 {
-	struct address_space *mapping = file->f_mapping;
-	long status = 0;
-	ssize_t written = 0;
-	vnode_t *vp = LZFS_ITOV(mapping->host);
-       
-	do {
-		status = lzfs_write(vp, file->f_flags, 
-				i->iov->iov_base, i->iov->iov_len, pos,
-				UIO_USERSPACE);
-		if (unlikely(status)) {
-			break;
-		}
-		pos += status;
-		written += status;
-	} while (iov_iter_count(i));
-	return written ? written : status;
+	ssize_t ret;
+	LZFS_OPSTAT(iocb->ki_filp->f_mapping->host, AIO_WRITE);
+
+	BUG_ON(iocb->ki_pos != pos);
+	LZFS_OPSTAT_IO(pos, iov_length(iov, nr_segs));
+	ret = lzfs_aio_rw(iocb, WRITE, iov, nr_segs, pos);
+	LZFS_OPSTAT_RC(ret);
+	tsd_exit();
+	return ret;
 }
 
-ssize_t
-lzfs_file_buffered_write(struct kiocb *iocb, const struct iovec *iov,
-                unsigned long nr_segs, loff_t pos, loff_t *ppos,
-                size_t count, ssize_t written)
+
+/*
+ * splice_write actor: the pipe page goes to zfs_write as it is, the only
+ * copy is the one into the ARC.  O_APPEND outputs never get here, the
+ * VFS refuses to splice to them.
+ */
+static int
+lzfs_splice_write_actor(struct pipe_inode_info *pipe, struct pipe_buffer *buf,
+		struct splice_desc *sd)
 {
-	struct file *file = iocb->ki_filp;
-	ssize_t status;
-	struct iov_iter i;
-       
-	iov_iter_init(&i, iov, nr_segs, count, written);
-	status = lzfs_perform_write(file, &i, pos);
+	struct file *filep  = sd->u.file;
+	struct inode *inode = filep->f_mapping->host;
+	struct iovec iov;
+	ssize_t rc;
+	char *data;
+
+	data = buf->ops->map(pipe, buf, 0);
+	iov.iov_base = data + buf->offset;
+	iov.iov_len  = sd->len;
+	rc = lzfs_write(LZFS_ITOV(inode), 0, data + buf->offset, sd->len,
+			sd->pos, UIO_SYSSPACE);
+	if (rc > 0 && filep->f_mapping->nrpages)
+		lzfs_update_pages(inode, sd->pos, rc, &iov, 1, UIO_SYSSPACE);
+	buf->ops->unmap(pipe, buf, data);
+
+	if (rc > 0) {
+		lzfs_io_account(inode->i_sb, LZFS_IO_WRITE, rc);
+		task_io_account_write(rc);
+	}
+	return rc;
+}
 
-	return status;
+static ssize_t
+lzfs_vnop_splice_write(struct pipe_inode_info *pipe, struct file *out,
+		loff_t *ppos, size_t len, unsigned int flags)
+{
+	struct inode *inode = out->f_mapping->host;
+	ssize_t ret;
+	LZFS_OPSTAT(inode, SPLICE_WRITE);
+
+	LZFS_OPSTAT_IO(*ppos, len);
+	if (lzfs_mnt_opt(inode, LZFS_MNT_PAGECACHE))
+		ret = generic_file_splice_write(pipe, out, ppos, len, flags);
+	else
+		ret = splice_from_pipe(pipe, out, ppos, len, flags,
+				lzfs_splice_write_actor);
+	LZFS_OPSTAT_RC(ret);
+	tsd_exit();
+	return ret;
 }
 
 static ssize_t
-__lzfs_vnop_aio_write(struct kiocb *iocb, const struct iovec *iov,
-                                unsigned long nr_segs, loff_t *ppos)
+lzfs_vnop_splice_read(struct file *in, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags)
 {
-	struct file *file = iocb->ki_filp;
-	struct address_space * mapping = file->f_mapping;
-	size_t ocount;          /* original count */
-	size_t count;           /* after file limit checks */
-	struct inode *inode = mapping->host;
-	loff_t pos;
-	ssize_t written;
-	ssize_t err;
+	struct timespec atime = in->f_mapping->host->i_atime;
+	loff_t pos            = *ppos;
+	ssize_t ret;
+	LZFS_OPSTAT(in->f_mapping->host, SPLICE_READ);
 
-	ocount = 0;
-	err = generic_segment_checks(iov, &nr_segs, &ocount, VERIFY_READ);
-	if(err) {
-		return err;
-	}
+	/*
+	 * Page cache pages are moved into the pipe by reference, readpages
+	 * fills them straight from zfs_read.  The direct read/write paths
+	 * keep any such pages coherent.
+	 */
+	LZFS_OPSTAT_IO(*ppos, len);
+	ret = generic_file_splice_read(in, ppos, pipe, len, flags);
+	LZFS_OPSTAT_RC(ret);
+	lzfs_io_account(in->f_mapping->host->i_sb, LZFS_IO_CACHE_READ, ret);
+	lzfs_pagecache_accessed(in, &atime, pos, ret);
+	tsd_exit();
+	return ret;
+}
+
+#ifndef SEEK_DATA
+#define SEEK_DATA	3
+#endif
+#ifndef SEEK_HOLE
+#define SEEK_HOLE	4
+#endif
 
-	count = ocount;
-	pos = *ppos;
+/* zfs ioctls backing SEEK_DATA/SEEK_HOLE, as in sys/filio.h */
+#ifndef _FIO_SEEK_DATA
+#define _FIO_SEEK_DATA	_IO('f', 88)
+#endif
+#ifndef _FIO_SEEK_HOLE
+#define _FIO_SEEK_HOLE	_IO('f', 89)
+#endif
+#ifndef FKIOCTL
+#define FKIOCTL		0x80000000
+#endif
 
-	written = 0;
+/* symbol exported by zfs module */
+extern int zfs_ioctl(vnode_t *vp, int com, intptr_t data, int flag,
+		cred_t *cred, int *rvalp, caller_context_t *ct);
 
-	err = generic_write_checks(file, &pos, &count, S_ISBLK(inode->i_mode));
-	if(err) {
-               goto out;
-	}
+/*
+ * SEEK_DATA/SEEK_HOLE ask zfs for the next allocated or unallocated
+ * offset, so sparse files can be copied without reading their holes.
+ * Everything else is the generic llseek.
+ */
+static loff_t
+lzfs_vnop_llseek(struct file *filep, loff_t offset, int origin)
+{
+	struct address_space *mapping = filep->f_mapping;
+	struct inode *inode = mapping->host;
+	offset_t off        = offset;
+	cred_t *cred;
+	int err;
+	LZFS_OPSTAT(inode, LLSEEK);
 
-	if(count == 0) {
+	LZFS_OPSTAT_IO(offset, 0);
+	if ((origin != SEEK_DATA && origin != SEEK_HOLE) ||
+	    !S_ISREG(inode->i_mode))
+		return generic_file_llseek(filep, offset, origin);
+
+	if (offset < 0) {
+		err = ENXIO;
 		goto out;
 	}
-               
-	file_update_time(file);
-	written = lzfs_file_buffered_write(iocb, iov, nr_segs,
-			pos, ppos, count, written);
+
+	/* mmap stores have no blocks in zfs until they are written back */
+	if (mapping_tagged(mapping, PAGECACHE_TAG_DIRTY)) {
+		err = -filemap_write_and_wait(mapping);
+		if (err)
+			goto out;
+	}
+
+	mutex_lock(&inode->i_mutex);
+	cred = LZFS_CRED();
+	err = zfs_ioctl(LZFS_ITOV(inode),
+			origin == SEEK_DATA ? _FIO_SEEK_DATA : _FIO_SEEK_HOLE,
+			(intptr_t) &off, FKIOCTL, (cred_t *) cred, NULL, NULL);
+	if (!err && off != filep->f_pos) {
+		filep->f_pos = off;
+		filep->f_version = 0;
+	}
+	mutex_unlock(&inode->i_mutex);
 out:
-	return written ? written : err;
+	LZFS_OPSTAT_RC(err ? -err : off);
+	tsd_exit();
+	return err ? -err : off;
 }
 
-ssize_t
-lzfs_vnop_aio_write(struct kiocb *iocb, const struct iovec *iov,
-                unsigned long nr_segs, loff_t pos)
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE	0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE	0x02
+#endif
+#ifndef F_FREESP
+#define F_FREESP		11
+#endif
+
+/* symbol exported by zfs module */
+extern int zfs_space(vnode_t *vp, int cmd, flock64_t *bfp, int flag,
+		offset_t offset, cred_t *cr, caller_context_t *ct);
+
+/*
+ * Free the blocks under [offset, offset + len).  Dirty pages are written
+ * back first so writeback cannot bring the data back afterwards, then
+ * every cached page touching the range is dropped, mapped ones included,
+ * and refaults from zfs.  The file size never changes.
+ */
+static int
+lzfs_punch_hole(struct inode *inode, loff_t offset, loff_t len,
+		const cred_t *cred)
 {
+	struct address_space *mapping = inode->i_mapping;
+	loff_t i_size = i_size_read(inode);
+	flock64_t bf;
+	int err;
 
-	ssize_t ret;
+	if (offset >= i_size)
+		return 0;
+	/* zfs_space would truncate a range running past EOF */
+	if (offset + len > i_size)
+		len = i_size - offset;
 
-	SENTRY;
-	BUG_ON(iocb->ki_pos != pos);
-	ret = __lzfs_vnop_aio_write(iocb, iov, nr_segs,
-				&iocb->ki_pos);
-	tsd_exit();
-	SEXIT;
-	return ret;
+	err = filemap_write_and_wait_range(mapping, offset, offset + len - 1);
+	if (err)
+		return err;
+
+	bf.l_type   = F_WRLCK;
+	bf.l_whence = 0;
+	bf.l_start  = offset;
+	bf.l_len    = len;
+	err = zfs_space(LZFS_ITOV(inode), F_FREESP, &bf, 0, offset,
+			(cred_t *) cred, NULL);
+	lzfs_attr_invalidate(inode);
+	if (err)
+		return -err;
+
+	/*
+	 * A page that cannot be dropped, one redirtied since the flush,
+	 * would keep showing the punched data.  Report it, as zfs already
+	 * freed the blocks.
+	 */
+	if (invalidate_inode_pages2_range(mapping, offset >> PAGE_CACHE_SHIFT,
+			(offset + len - 1) >> PAGE_CACHE_SHIFT))
+		return -EBUSY;
+	return 0;
+}
+
+/*
+ * ZFS is copy on write, blocks written now are not the ones a later
+ * write lands in, so there is nothing to reserve.  The cheapest honest
+ * answer is to fail up front when the pool cannot hold the range and
+ * otherwise grow the file sparsely unless KEEP_SIZE was asked for.
+ */
+static int
+lzfs_prealloc(struct inode *inode, int mode, loff_t offset, loff_t len,
+		const cred_t *cred)
+{
+	vnode_t *vp = LZFS_ITOV(inode);
+	vattr_t vap;
+	int err;
+
+	err = lzfs_space_check(inode, len);
+	if (err)
+		return -err;
+
+	if ((mode & FALLOC_FL_KEEP_SIZE) ||
+	    offset + len <= i_size_read(inode))
+		return 0;
+
+	/* zfs first, i_size must never run ahead of the file it has */
+	err = inode_newsize_ok(inode, offset + len);
+	if (err)
+		return err;
+
+	bzero(&vap, sizeof(vap));
+	vap.va_type = IFTOVT(inode->i_mode);
+	vap.va_mask = AT_TYPE | AT_SIZE;
+	vap.va_size = offset + len;
+	err = zfs_setattr(vp, &vap, 0, (cred_t *) cred, NULL);
+	lzfs_attr_invalidate(inode);
+	if (err)
+		return -err;
+
+	return vmtruncate(inode, offset + len);
 }
 
+static long
+lzfs_vnop_fallocate(struct inode *inode, int mode, loff_t offset, loff_t len)
+{
+	cred_t *cred;
+	long err;
+	LZFS_OPSTAT(inode, FALLOCATE);
+
+	LZFS_OPSTAT_IO(offset, len);
+	if (!S_ISREG(inode->i_mode))
+		return -ENODEV;
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+		return -EOPNOTSUPP;
+
+	mutex_lock(&inode->i_mutex);
+	cred = LZFS_CRED();
+	if (mode & FALLOC_FL_PUNCH_HOLE)
+		err = lzfs_punch_hole(inode, offset, len, cred);
+	else
+		err = lzfs_prealloc(inode, mode, offset, len, cred);
+	mutex_unlock(&inode->i_mutex);
+	LZFS_OPSTAT_RC(err);
+	tsd_exit();
+	return err;
+}
 
 const struct inode_operations zfs_inode_operations = {
 	.getattr	= lzfs_vnop_getattr,
@@ -1199,19 +1974,22 @@ const struct inode_operations zfs_inode_operations = {
 	.getxattr       = generic_getxattr,
 	.listxattr      = lzfs_listxattr,
 	.removexattr    = lzfs_removexattr,
+	.fallocate      = lzfs_vnop_fallocate,
 };
 
 const struct file_operations zfs_file_operations = {
 	.open               = lzfs_vnop_open,
-    //.llseek           = generic_file_llseek,
+	.llseek             = lzfs_vnop_llseek,
 	.read               = lzfs_vnop_read,
 	.write              = lzfs_vnop_write,
 	.readdir            = lzfs_vnop_readdir,
 	.mmap               = lzfs_file_mmap,
     //.unlocked_ioctl   = lzfs_fop_ioctl,
 	.fsync              = lzfs_vnop_fsync,
-//	.aio_read           = lzfs_vnop_aio_read,
-//	.aio_write          = lzfs_vnop_aio_write,
+	.aio_read           = lzfs_vnop_aio_read,
+	.aio_write          = lzfs_vnop_aio_write,
+	.splice_read        = lzfs_vnop_splice_read,
+	.splice_write       = lzfs_vnop_splice_write,
 };
 
 const struct inode_operations zfs_dir_inode_operations ={
@@ -1238,151 +2016,664 @@ const struct file_operations zfs_dir_file_operations = {
 	.readdir        = lzfs_vnop_readdir,
 //     .unlocked_ioctl = lzfs_fop_ioctl,
 	.fsync          = lzfs_vnop_fsync,
+	.release        = lzfs_dir_release,
 
 };
 
-static int lzfs_readpage(struct file *file, struct page *page)
+/*
+ * Fill a locked page cache page from zfs.  Whatever lies beyond EOF is
+ * zeroed.  On success the page is marked uptodate.
+ */
+static int lzfs_fill_page(struct page *page)
 {
-    const cred_t *cred  = get_current_cred();
-    struct inode *inode = NULL;
-    loff_t i_size       = 0;
-    loff_t offset       = 0;
-    int err             = 0;
-    char *buf           = NULL;
-    vnode_t *vp         = NULL;
-    unsigned long fillsize = 0;
+	struct inode *inode = page->mapping->host;
+	vnode_t *vp         = LZFS_ITOV(inode);
+	loff_t i_size       = i_size_read(inode);
+	loff_t offset       = page_offset(page);
+	unsigned long fillsize = 0;
+	int err             = 0;
+	char *buf;
 	ssize_t rc;
 
-    BUG_ON(!PageLocked(page));
-//    printk(KERN_ERR "%s: ==>\n", __FUNCTION__);
-    inode  = page->mapping->host;
-    vp     = LZFS_ITOV(inode);
-    i_size = i_size_read(inode);
-    offset = page_offset(page);
-
-    /* Is the page fully outside i_size? (truncate in progress) */
-    if (unlikely(page->index >= (i_size + PAGE_CACHE_SIZE - 1) >>
-                PAGE_CACHE_SHIFT)) {
-        zero_user(page, 0, PAGE_CACHE_SIZE);
-        printk(KERN_ERR "Read outside i_size - truncated?");
-    	SetPageUptodate(page);
-        goto out;
-    }
-
-    if (NULL == (buf = kmap(page))) {
-        err = -ENOMEM;
-        goto out;
-    }
-
-    if (offset < i_size) {
-        i_size -= offset;
-        fillsize = i_size > PAGE_CACHE_SIZE ? PAGE_CACHE_SIZE : i_size;
+	buf = kmap(page);
+	if (offset < i_size) {
+		i_size -= offset;
+		fillsize = i_size > PAGE_CACHE_SIZE ? PAGE_CACHE_SIZE : i_size;
 
 		rc = lzfs_read(vp, buf, fillsize, offset, UIO_SYSSPACE);
-        if (unlikely(rc < 0)) {
-            fillsize = 0;
-            err = -EIO;
-        }
-    }
+		if (unlikely(rc < 0)) {
+			fillsize = 0;
+			err = -EIO;
+		} else {
+			lzfs_io_account(inode->i_sb, LZFS_IO_FILL, rc);
+			task_io_account_read(rc);
+			/* zfs EOF trails i_size while "writeback" data is dirty */
+			fillsize = rc;
+		}
+	}
 
-    if (fillsize < PAGE_CACHE_SIZE)
-        memset(buf + fillsize, 0, PAGE_CACHE_SIZE - fillsize);
+	if (fillsize < PAGE_CACHE_SIZE)
+		memset(buf + fillsize, 0, PAGE_CACHE_SIZE - fillsize);
+	kunmap(page);
 
-    if (!err) {
-        SetPageUptodate(page);
+	if (!err) {
+		SetPageUptodate(page);
 		ClearPageError(page);
-    	flush_dcache_page(page);
+		flush_dcache_page(page);
 	} else {
 		ClearPageUptodate(page);
-        SetPageError(page);
+		SetPageError(page);
+	}
+	return err;
+}
+
+static int lzfs_readpage(struct file *file, struct page *page)
+{
+	int err;
+	LZFS_OPSTAT(page->mapping->host, READPAGE);
+
+	BUG_ON(!PageLocked(page));
+	LZFS_OPSTAT_IO(page_offset(page), PAGE_CACHE_SIZE);
+	err = lzfs_fill_page(page);
+	LZFS_OPSTAT_RC(err);
+	unlock_page(page);
+	return err;
+}
+
+/*
+ * Largest zfs record, a contiguous page run never spans more.
+ */
+#define LZFS_RUN_MAX_PAGES	(((128 * 1024) >> PAGE_CACHE_SHIFT) ?: 1)
+
+/*
+ * A contiguous, record aligned run of locked pages which is moved to or
+ * from zfs with a single multi-iovec uio.
+ */
+typedef struct lzfs_run {
+	struct list_head	lr_list;
+	vnode_t			*lr_vp;
+	const struct cred	*lr_cred;
+	int			lr_npages;
+	struct page		*lr_pages[LZFS_RUN_MAX_PAGES];
+	struct iovec		lr_iov[LZFS_RUN_MAX_PAGES];
+} lzfs_run_t;
+
+static void lzfs_fill_run(lzfs_run_t *lr)
+{
+	struct inode *inode = LZFS_VTOI(lr->lr_vp);
+	loff_t pos          = page_offset(lr->lr_pages[0]);
+	ssize_t len         = lr->lr_npages << PAGE_CACHE_SHIFT;
+	ssize_t done        = 0;
+	int err             = 0;
+	int i;
+
+	for (i = 0; i < lr->lr_npages; i++) {
+		lr->lr_iov[i].iov_base = kmap(lr->lr_pages[i]);
+		lr->lr_iov[i].iov_len  = PAGE_CACHE_SIZE;
 	}
 
-    kunmap(page);
+	if (pos < i_size_read(inode)) {
+		uio_t uio = {
+			.uio_iov      = lr->lr_iov,
+			.uio_iovcnt   = lr->lr_npages,
+			.uio_loffset  = (offset_t) pos,
+			.uio_resid    = len,
+			.uio_segflg   = UIO_SYSSPACE,
+		};
+
+		err = zfs_read(lr->lr_vp, &uio, 0, (cred_t *) lr->lr_cred, NULL);
+		lzfs_attr_accessed(inode);
+		done = len - uio.uio_resid;
+		/* the task is charged by lzfs_readpages, this may be a worker */
+		lzfs_io_account(inode->i_sb, LZFS_IO_FILL, done);
+	}
 
-out:
-    unlock_page(page);
-//    printk(KERN_ERR "%s: <==\n", __FUNCTION__);
-    put_cred(cred);
-    return err;
+	for (i = 0; i < lr->lr_npages; i++) {
+		struct page *page = lr->lr_pages[i];
+		ssize_t off = (ssize_t) i << PAGE_CACHE_SHIFT;
+
+		/* zero whatever zfs_read did not fill, i.e. past EOF */
+		if (done < off + PAGE_CACHE_SIZE) {
+			ssize_t from = done > off ? done - off : 0;
+			memset((char *) lr->lr_iov[i].iov_base + from, 0,
+					PAGE_CACHE_SIZE - from);
+		}
+		kunmap(page);
+
+		if (!err) {
+			SetPageUptodate(page);
+			ClearPageError(page);
+			flush_dcache_page(page);
+		} else {
+			SetPageError(page);
+		}
+		unlock_page(page);
+		page_cache_release(page);
+	}
+}
+
+static void lzfs_run_free(lzfs_run_t *lr)
+{
+	put_cred(lr->lr_cred);
+	kfree(lr);
+}
+
+static void lzfs_run_task(void *arg)
+{
+	lzfs_run_t *lr = arg;
+
+	lzfs_fill_run(lr);
+	lzfs_run_free(lr);
+	tsd_exit();
+}
+
+/*
+ * Readahead and mmap faults hand us a window of pages, possibly with
+ * holes where pages were already cached.  Each contiguous, record aligned
+ * run becomes one zfs_read.  The first run is filled by the caller, the
+ * remaining runs are handed to the fill worker pool so they are filled
+ * in parallel.
+ */
+static int
+lzfs_readpages(struct file *file, struct address_space *mapping,
+		struct list_head *pages, unsigned nr_pages)
+{
+	struct inode *inode = mapping->host;
+	vnode_t *vp         = LZFS_ITOV(inode);
+	taskq_t *tq         = lzfs_fill_taskq;
+	unsigned long rpages = lzfs_recordsize(inode) >> PAGE_CACHE_SHIFT;
+	lzfs_run_t *lr     = NULL;
+	lzfs_run_t *first, *next;
+	unsigned long nr_run = 0;
+	LIST_HEAD(runs);
+	LZFS_OPSTAT(inode, READPAGES);
+
+	rpages = clamp_t(unsigned long, rpages, 1, LZFS_RUN_MAX_PAGES);
+
+	while (!list_empty(pages)) {
+		struct page *page = list_entry(pages->prev, struct page, lru);
+
+		list_del(&page->lru);
+		if (add_to_page_cache_lru(page, mapping, page->index,
+					GFP_KERNEL)) {
+			/* somebody else cached it, this ends the run */
+			page_cache_release(page);
+			lr = NULL;
+			continue;
+		}
+
+		if (lr && (lr->lr_npages == rpages ||
+		    !(page->index & (rpages - 1)) ||
+		    page->index != lr->lr_pages[lr->lr_npages - 1]->index + 1))
+			lr = NULL;
+
+		if (!lr) {
+			lr = kmalloc(sizeof (lzfs_run_t), GFP_KERNEL);
+			if (unlikely(!lr)) {
+				lzfs_fill_page(page);
+				unlock_page(page);
+				page_cache_release(page);
+				continue;
+			}
+			lr->lr_vp     = vp;
+			lr->lr_cred   = get_current_cred();
+			lr->lr_npages = 0;
+			list_add_tail(&lr->lr_list, &runs);
+		}
+		lr->lr_pages[lr->lr_npages++] = page;
+		nr_run++;
+	}
+
+	if (list_empty(&runs))
+		return 0;
+
+	/* charged up front, whichever thread ends up filling the run */
+	task_io_account_read(nr_run << PAGE_CACHE_SHIFT);
+
+	first = list_first_entry(&runs, lzfs_run_t, lr_list);
+	lr = first;
+	list_for_each_entry_safe_continue(lr, next, &runs, lr_list) {
+		list_del(&lr->lr_list);
+		if (!taskq_dispatch(tq, lzfs_run_task, lr, TQ_SLEEP))
+			lzfs_run_task(lr);
+	}
+
+	lzfs_fill_run(first);
+	lzfs_run_free(first);
+	return 0;
+}
+
+/*
+ * Write back a run of contiguous, locked pages which have been cleared for
+ * I/O with a single zfs_write, so the whole run costs one transaction.
+ * The last page is clipped at i_size, so writeback extends the zfs file
+ * no further than a "writeback" write_end grew the inode.
+ * Consumes the page locks and one page reference per page.
+ */
+static int
+lzfs_writeback_run(vnode_t *vp, struct page **pages, struct iovec *iov,
+		int npages, const struct cred *cred)
+{
+	struct inode *inode = LZFS_VTOI(vp);
+	loff_t pos          = page_offset(pages[0]);
+	loff_t end          = pos + ((loff_t) npages << PAGE_CACHE_SHIFT);
+	loff_t i_size       = i_size_read(inode);
+	int err             = 0;
+	int i;
+
+	for (i = 0; i < npages; i++) {
+		set_page_writeback(pages[i]);
+		iov[i].iov_base = kmap(pages[i]);
+		iov[i].iov_len  = PAGE_CACHE_SIZE;
+	}
+	if (end > i_size) {
+		iov[npages - 1].iov_len -= end - i_size;
+		end = i_size;
+	}
+
+	if (end > pos) {
+		uio_t uio = {
+			.uio_iov      = iov,
+			.uio_iovcnt   = npages,
+			.uio_loffset  = (offset_t) pos,
+			.uio_resid    = end - pos,
+			.uio_segflg   = UIO_SYSSPACE,
+			.uio_limit    = MAXOFFSET_T,
+		};
+
+		/*
+		 * No FAPPEND here whatever the file was opened with, the
+		 * data belongs at the page offset.
+		 */
+		err = zfs_write(vp, &uio, 0, (cred_t *) cred, NULL);
+		lzfs_attr_invalidate(inode);
+		lzfs_io_account(inode->i_sb, LZFS_IO_WRITEBACK,
+				end - pos - uio.uio_resid);
+		if (!err && uio.uio_resid)
+			err = EIO;
+	}
+
+	for (i = 0; i < npages; i++) {
+		struct page *page = pages[i];
+
+		kunmap(page);
+		if (err)
+			SetPageError(page);
+		else
+			ClearPageError(page);
+		unlock_page(page);
+		end_page_writeback(page);
+		page_cache_release(page);
+	}
+
+	if (err)
+		mapping_set_error(inode->i_mapping, -err);
+	return -err;
 }
 
 static int lzfs_writepage(struct page *page, struct writeback_control *wbc)
 {
-    struct inode *inode = NULL;
-    loff_t i_size       = 0;
-    loff_t offset       = 1;
-    ssize_t len         = 0;
-    int err             = 0;
-    char *buf           = NULL;
-    vnode_t *vp         = NULL;
-    struct file *filep  = NULL;
-
-//    printk(KERN_ERR "%s: ==>\n", __FUNCTION__);
-    inode  = page->mapping->host;
-    vp     = LZFS_ITOV(inode);
-    filep  = vp->v_file;
-    i_size = i_size_read(inode);
-    offset = page_offset(page);
-
-    BUG_ON(!PageLocked(page));
-    BUG_ON(!filep);
-
-    if (NULL == (buf = kmap(page))) {
-        err = -ENOMEM;
-        goto out;
-    }
+	struct inode *inode = page->mapping->host;
+	struct iovec iov;
+	cred_t *cred;
+	int err;
+	LZFS_OPSTAT(inode, WRITEPAGE);
 
-#if 0 
-    for (i = 0; i < PAGE_CACHE_SIZE; i++) {
-        if (buf[i] != 0) {
-            printk(KERN_ERR "%c", buf[i]);
-        }
-    }
-    printk(KERN_ERR "\n");
-#endif
+	BUG_ON(!PageLocked(page));
 
-    /* WE ARE USING PAGE CACHE ONLY FOR MMAP, WE WOULD NEVER HAVE TO 
-     * INCREASE THE SIZE OF A FILE IN writepage */
-    len = PAGE_CACHE_SIZE;
-    if ((offset + len) > i_size) {
-        len = i_size & ~PAGE_CACHE_MASK;
-    }
+	/* wholly past EOF, truncate is about to drop it */
+	if (page_offset(page) >= i_size_read(inode)) {
+		unlock_page(page);
+		return 0;
+	}
 
-    /*
-     * zfs_write handles the FAPPEND flag by changing the file offset 
-     * to the end of the file, but the we are in writepage and data 
-     * should be written to same offset that we provide to zfs_write.
-     * */
-	len = lzfs_write(vp, filep->f_flags & ~FAPPEND, buf, len, offset, UIO_SYSSPACE);
-    if (unlikely(len < 0)) {
-		ClearPageUptodate(page);
-        SetPageError(page);
-        err = -EIO;
+	cred = LZFS_CRED();
+	page_cache_get(page);
+	LZFS_OPSTAT_IO(page_offset(page), PAGE_CACHE_SIZE);
+	err = lzfs_writeback_run(LZFS_ITOV(inode), &page, &iov, 1, cred);
+	LZFS_OPSTAT_RC(err);
+	return err;
+}
+
+/*
+ * Walk the dirty pages of the mapping and write each contiguous, record
+ * aligned run with one zfs_write, so msync and background writeback of
+ * mmapped files cost one transaction per record rather than per page.
+ */
+static int
+lzfs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	unsigned long rpages = lzfs_recordsize(inode) >> PAGE_CACHE_SHIFT;
+	struct pagevec pvec;
+	lzfs_run_t *lr;
+	pgoff_t index, end;
+	pgoff_t start_index = 0;
+	int range_whole     = 0;
+	int cycled          = 1;
+	int done            = 0;
+	int err             = 0;
+	int rc, nr, i;
+	LZFS_OPSTAT(inode, WRITEPAGES);
+
+	lr = kmalloc(sizeof (lzfs_run_t), GFP_NOFS);
+	if (unlikely(!lr))
+		return generic_writepages(mapping, wbc);
+
+	rpages = clamp_t(unsigned long, rpages, 1, LZFS_RUN_MAX_PAGES);
+	lr->lr_vp     = LZFS_ITOV(inode);
+	lr->lr_cred   = LZFS_CRED();
+	lr->lr_npages = 0;
+
+	pagevec_init(&pvec, 0);
+	if (wbc->range_cyclic) {
+		start_index = index = mapping->writeback_index;
+		cycled = (index == 0);
+		end = -1;
 	} else {
-    	SetPageUptodate(page);
-		ClearPageError(page);
+		index = wbc->range_start >> PAGE_CACHE_SHIFT;
+		end = wbc->range_end >> PAGE_CACHE_SHIFT;
+		if (wbc->range_start == 0 && wbc->range_end == LLONG_MAX)
+			range_whole = 1;
 	}
-    kunmap(page);
-out:
-//    page_clear_dirty(page);
-    unlock_page(page);
-//    printk(KERN_ERR "%s: <==\n", __FUNCTION__);
-    return err;
+
+retry:
+	while (!done && index <= end) {
+		nr = pagevec_lookup_tag(&pvec, mapping, &index,
+				PAGECACHE_TAG_DIRTY,
+				min(end - index, (pgoff_t) PAGEVEC_SIZE - 1) + 1);
+		if (nr == 0)
+			break;
+
+		for (i = 0; i < nr; i++) {
+			struct page *page = pvec.pages[i];
+
+			if (page->index > end) {
+				done = 1;
+				break;
+			}
+
+			/* a gap or a record boundary ends the current run */
+			if (lr->lr_npages && (lr->lr_npages == rpages ||
+			    !(page->index & (rpages - 1)) ||
+			    page->index !=
+			    lr->lr_pages[lr->lr_npages - 1]->index + 1)) {
+				rc = lzfs_writeback_run(lr->lr_vp, lr->lr_pages,
+						lr->lr_iov, lr->lr_npages,
+						lr->lr_cred);
+				lr->lr_npages = 0;
+				if (rc && !err)
+					err = rc;
+			}
+
+			lock_page(page);
+			if (unlikely(page->mapping != mapping) ||
+			    !PageDirty(page)) {
+				unlock_page(page);
+				continue;
+			}
+			if (PageWriteback(page)) {
+				if (wbc->sync_mode == WB_SYNC_NONE) {
+					unlock_page(page);
+					continue;
+				}
+				wait_on_page_writeback(page);
+			}
+			if (!clear_page_dirty_for_io(page)) {
+				unlock_page(page);
+				continue;
+			}
+			if (page_offset(page) >= i_size_read(inode)) {
+				unlock_page(page);
+				continue;
+			}
+
+			page_cache_get(page);
+			lr->lr_pages[lr->lr_npages++] = page;
+
+			if (--wbc->nr_to_write <= 0 &&
+			    wbc->sync_mode == WB_SYNC_NONE) {
+				done = 1;
+				break;
+			}
+		}
+		pagevec_release(&pvec);
+		cond_resched();
+	}
+
+	if (lr->lr_npages) {
+		rc = lzfs_writeback_run(lr->lr_vp, lr->lr_pages, lr->lr_iov,
+				lr->lr_npages, lr->lr_cred);
+		lr->lr_npages = 0;
+		if (rc && !err)
+			err = rc;
+	}
+
+	/* cyclic writeback started mid file, wrap around once */
+	if (!cycled && !done) {
+		cycled = 1;
+		index = 0;
+		end = start_index - 1;
+		goto retry;
+	}
+
+	if (wbc->range_cyclic || (range_whole && wbc->nr_to_write > 0))
+		mapping->writeback_index = index;
+
+	kfree(lr);
+	LZFS_OPSTAT_RC(err);
+	return err;
+}
+
+/*
+ * Buffered writes in "pagecache" mode.  The data is copied into the page
+ * cache and immediately written through to zfs in write_end, so zfs still
+ * owns persistence and the page is left clean.  That is one zfs_write,
+ * and so one transaction, per page the write touches.  In "writeback"
+ * mode the page is only dirtied and lzfs_writepages hands runs of them
+ * to zfs later, one transaction per record.
+ */
+static int
+lzfs_write_begin(struct file *file, struct address_space *mapping,
+		loff_t pos, unsigned len, unsigned flags,
+		struct page **pagep, void **fsdata)
+{
+	pgoff_t index = pos >> PAGE_CACHE_SHIFT;
+	unsigned from = pos & (PAGE_CACHE_SIZE - 1);
+	struct page *page;
+	int err;
+	LZFS_OPSTAT(mapping->host, WRITE_BEGIN);
+
+	LZFS_OPSTAT_IO(pos, len);
+	page = grab_cache_page_write_begin(mapping, index, flags);
+	if (!page)
+		return -ENOMEM;
+
+	/* a page already dirty was checked when it was dirtied */
+	if (lzfs_mnt_opt(mapping->host, LZFS_MNT_WRITEBACK) &&
+	    !PageDirty(page)) {
+		err = lzfs_space_check(mapping->host, PAGE_CACHE_SIZE);
+		if (err) {
+			LZFS_OPSTAT_RC(-err);
+			unlock_page(page);
+			page_cache_release(page);
+			return -err;
+		}
+	}
+	*pagep = page;
+
+	if (PageUptodate(page) || len == PAGE_CACHE_SIZE)
+		return 0;
+
+	/* nothing to read in past EOF, write_end finishes the page */
+	if (page_offset(page) >= i_size_read(mapping->host)) {
+		zero_user_segments(page, 0, from,
+				from + len, PAGE_CACHE_SIZE);
+		return 0;
+	}
+
+	err = lzfs_fill_page(page);
+	LZFS_OPSTAT_RC(err);
+	if (err) {
+		unlock_page(page);
+		page_cache_release(page);
+		*pagep = NULL;
+	}
+	return err;
 }
 
+/*
+ * write_end of "writeback" mode.  zfs only learns of the data, and of a
+ * file grown by it, when the page is written back, until then i_size is
+ * the file size and getattr reports it.  Returns the bytes taken.
+ */
+static ssize_t
+lzfs_write_end_dirty(struct inode *inode, loff_t pos, unsigned len,
+		unsigned copied, struct page *page)
+{
+	/*
+	 * A page write_begin did not read in holds garbage outside what
+	 * was copied, a short copy into it has to be redone.
+	 */
+	if (!PageUptodate(page)) {
+		if (copied < len)
+			return 0;
+		SetPageUptodate(page);
+	}
+	if (!copied)
+		return 0;
+
+	set_page_dirty(page);
+	if (pos + copied > i_size_read(inode))
+		i_size_write(inode, pos + copied);
+	/* set_page_dirty charged the task when the page went dirty */
+	lzfs_io_account(inode->i_sb, LZFS_IO_CACHE_WRITE, copied);
+	return copied;
+}
+
+static int
+lzfs_write_end(struct file *file, struct address_space *mapping,
+		loff_t pos, unsigned len, unsigned copied,
+		struct page *page, void *fsdata)
+{
+	struct inode *inode = mapping->host;
+	vnode_t *vp = LZFS_ITOV(inode);
+	unsigned from = pos & (PAGE_CACHE_SIZE - 1);
+	ssize_t rc = 0;
+	char *buf;
+	LZFS_OPSTAT(inode, WRITE_END);
+
+	LZFS_OPSTAT_IO(pos, copied);
+	if (lzfs_mnt_opt(inode, LZFS_MNT_WRITEBACK)) {
+		rc = lzfs_write_end_dirty(inode, pos, len, copied, page);
+		goto out;
+	}
 
+	/*
+	 * A page write_begin did not read in holds garbage outside what
+	 * was copied, a short copy into it has to be redone rather than
+	 * zero filled over file data.
+	 */
+	if (!PageUptodate(page)) {
+		if (copied < len)
+			goto out;
+		SetPageUptodate(page);
+	}
+
+	if (copied) {
+		/*
+		 * generic_write_checks() already moved pos to EOF for
+		 * O_APPEND, do not let zfs_write move it again.
+		 */
+		buf = kmap(page);
+		rc = lzfs_write(vp, file->f_flags & ~FAPPEND, buf + from,
+				copied, pos, UIO_SYSSPACE);
+		kunmap(page);
+	}
+
+	if (unlikely(rc < 0)) {
+		/* the page no longer matches zfs, read it back */
+		lzfs_fill_page(page);
+		copied = 0;
+	} else {
+		lzfs_io_account(inode->i_sb, LZFS_IO_CACHE_WRITE, rc);
+		task_io_account_write(rc);
+		copied = rc;
+		if (pos + copied > i_size_read(inode))
+			i_size_write(inode, pos + copied);
+		rc = copied;
+	}
+
+out:
+	unlock_page(page);
+	page_cache_release(page);
+	LZFS_OPSTAT_RC(rc);
+	return rc;
+}
+
+/*
+ * O_DIRECT.  The generic code has already written back and invalidated
+ * the cached pages of the range, so the caller's iovecs go straight to
+ * zfs in one uio and the data is cached in the ARC only.
+ */
 static ssize_t
 lzfs_direct_IO(int rw, struct kiocb *iocb, const struct iovec *iov,
-                        loff_t offset, unsigned long nr_segs)
+		loff_t offset, unsigned long nr_segs)
 {
-        BUG_ON(1);
-        return -1;
+	struct file *filep  = iocb->ki_filp;
+	vnode_t *vp         = LZFS_ITOV(filep->f_mapping->host);
+	size_t len          = iov_length(iov, nr_segs);
+	ssize_t done;
+	cred_t *cred;
+	lzfs_uio_t lu;
+	int err;
+	LZFS_OPSTAT(filep->f_mapping->host, DIRECT_IO);
+
+	LZFS_OPSTAT_IO(offset, len);
+	/*
+	 * The generic code keeps using iov for the buffered fallback after
+	 * a short write, so zfs gets a private copy.
+	 */
+	err = lzfs_uio_init(&lu, iov, nr_segs, len, offset, UIO_USERSPACE);
+	if (err)
+		return err;
+
+	cred = LZFS_CRED();
+	if (rw & WRITE) {
+		/* generic_write_checks() already resolved O_APPEND */
+		err = zfs_write(vp, &lu.lu_uio, filep->f_flags & ~FAPPEND,
+				(cred_t *) cred, NULL);
+		lzfs_attr_invalidate(LZFS_VTOI(vp));
+	} else {
+		err = zfs_read(vp, &lu.lu_uio, 0, (cred_t *) cred, NULL);
+		lzfs_attr_accessed(LZFS_VTOI(vp));
+	}
+	lzfs_uio_fini(&lu);
+
+	done = len - lu.lu_uio.uio_resid;
+	if (rw & WRITE) {
+		lzfs_io_account(filep->f_mapping->host->i_sb, LZFS_IO_WRITE,
+				done);
+		task_io_account_write(done);
+	} else {
+		lzfs_io_account(filep->f_mapping->host->i_sb, LZFS_IO_READ,
+				done);
+		task_io_account_read(done);
+	}
+	LZFS_OPSTAT_RC(err && !done ? -err : done);
+	if (unlikely(err) && !done)
+		return -err;
+	return done;
 }
 
 
 const struct address_space_operations zfs_address_space_operations = {
 	.readpage = lzfs_readpage,
+	.readpages = lzfs_readpages,
 	.writepage = lzfs_writepage,
+	.writepages = lzfs_writepages,
+	.write_begin = lzfs_write_begin,
+	.write_end = lzfs_write_end,
 	.direct_IO = lzfs_direct_IO,
 };
 
@@ -1393,10 +2684,8 @@ const struct address_space_operations zfs_address_space_operations = {
 void
 lzfs_set_inode_ops(struct inode *inode)
 {
-/*
-	printk("%s inode number %ld i_mode %x\n", 
-	       __FUNCTION__, inode->i_ino, inode->i_mode);
-*/
+	/* dirty pages and inodes are written back by the mount's flusher */
+	inode->i_mapping->backing_dev_info = inode->i_sb->s_bdi;
 
 	switch (inode->i_mode & S_IFMT) {
 	case S_IFREG:
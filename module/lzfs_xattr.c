@@ -8,6 +8,9 @@
 #include <lzfs_xattr.h>
 #include <linux/xattr.h>
 #include <spl-debug.h>
+#include <lzfs_cred.h>
+#include <lzfs_opstat.h>
+#include <linux/task_io_accounting_ops.h>
 
 #ifdef SS_DEBUG_SUBSYS
 #undef SS_DEBUG_SUBSYS
@@ -27,7 +30,7 @@ lzfs_xattr_get(struct inode *inode, const char *name,
 	vnode_t *dvp;
 	vnode_t *xvp;
 	int err = 0;
-	const struct cred *cred = get_current_cred();
+	cred_t *cred = LZFS_CRED();
 	struct iovec iov;
 	uio_t uio;
 	char *xattr_name = NULL;
@@ -71,10 +74,11 @@ lzfs_xattr_get(struct inode *inode, const char *name,
 	uio.uio_segflg  = UIO_SYSSPACE;
 
 	err = zfs_read(xvp, &uio, 0, (cred_t *)cred, NULL);
-	put_cred(cred);
 	if(err) {
 		return -err;
 	}
+	lzfs_io_account(inode->i_sb, LZFS_IO_XATTR_READ, size - uio.uio_resid);
+	task_io_account_read(size - uio.uio_resid);
 
 	return size - uio.uio_resid;
 }
@@ -177,7 +181,7 @@ lzfs_listxattr(struct dentry *dentry, char *buffer, size_t size)
 	vnode_t *dvp;
 	vnode_t *vp; /* xattr dir vnode pointer */
 	int err = 0, eof;
-	const struct cred *cred = get_current_cred();
+	cred_t *cred = LZFS_CRED();
 	loff_t pos = 0;
 
 	struct listxattr_buf buf = {
@@ -189,6 +193,7 @@ lzfs_listxattr(struct dentry *dentry, char *buffer, size_t size)
 		.buf = buffer,
 		.size = buffer ? size : 0,
 	};
+	LZFS_OPSTAT(dentry->d_inode, LISTXATTR);
 
 	dvp = LZFS_ITOV(dentry->d_inode);
 	err = zfs_lookup(dvp, NULL, &vp, NULL, LOOKUP_XATTR, NULL,
@@ -221,6 +226,8 @@ lzfs_removexattr(struct dentry *dentry, const char *name)
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
 	const struct xattr_handler *handler;
 #endif
+	LZFS_OPSTAT(dentry->d_inode, REMOVEXATTR);
+
 	handler = find_xattr_handler_prefix(inode->i_sb->s_xattr, name);
 
 	if (!handler)
@@ -8,6 +8,9 @@
 #include <lzfs_xattr.h>
 #include <linux/xattr.h>
 #include <spl-debug.h>
+#include <lzfs_cred.h>
+#include <lzfs_opstat.h>
+#include <linux/task_io_accounting_ops.h>
 
 #ifdef SS_DEBUG_SUBSYS
 #undef SS_DEBUG_SUBSYS
@@ -28,6 +31,8 @@ lzfs_xattr_user_get(struct dentry *dentry, const char *name,
 			void *buffer, size_t size, int type)
 #endif
 {
+	LZFS_OPSTAT(LZFS_XATTR_INODE, XATTR_GET);
+
 	if(strcmp(name,"") == 0) {
 		return -EINVAL;
 	}
@@ -53,9 +58,9 @@ lzfs_xattr_user_set(struct dentry *dentry, const char *name,
 	vnode_t *vp;
 	vnode_t *dvp;
 	vnode_t *xvp;
-	vattr_t *vap;
+	vattr_t vap;
 	int err = 0;
-	const struct cred *cred = get_current_cred();
+	cred_t *cred = LZFS_CRED();
 	struct iovec iov = {
 		.iov_base = (void *) value,
 		.iov_len  = size,
@@ -70,6 +75,8 @@ lzfs_xattr_user_set(struct dentry *dentry, const char *name,
 		.uio_limit   = MAXOFFSET_T,
 		.uio_segflg  = UIO_SYSSPACE,
 	};
+	LZFS_OPSTAT(LZFS_XATTR_INODE, XATTR_SET);
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35)
 	dvp = LZFS_ITOV(inode);
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
@@ -83,28 +90,31 @@ lzfs_xattr_user_set(struct dentry *dentry, const char *name,
 	if(!value) {
 		err =zfs_remove(vp, (char *) name,
 			(struct cred *)cred, NULL, 0);
+		lzfs_attr_invalidate(LZFS_VTOI(dvp));
 		return -err;
 	}
-	vap = kmalloc(sizeof(vattr_t), GFP_KERNEL);
-	ASSERT(vap != NULL);
-	memset(vap, 0, sizeof(vap));
-	vap->va_type = VREG;
-	vap->va_mode = 0644;
-	vap->va_mask = AT_TYPE|AT_MODE;
-	vap->va_uid = current_fsuid();
-	vap->va_gid = current_fsgid();
+	bzero(&vap, sizeof(vap));
+	vap.va_type = VREG;
+	vap.va_mode = 0644;
+	vap.va_mask = AT_TYPE|AT_MODE;
+	vap.va_uid = current_fsuid();
+	vap.va_gid = current_fsgid();
 	xattr_name = kzalloc(strlen(name) + 6, GFP_KERNEL);
 	xattr_name = strncpy(xattr_name, "user.", 5);
 	xattr_name = strncat(xattr_name, name, strlen(name));
-	err = zfs_create(vp, xattr_name, vap, 0, 0644,
+	err = zfs_create(vp, xattr_name, &vap, 0, 0644,
 			&xvp, (struct cred *)cred, 0, NULL, NULL);
-	kfree(vap);
 	kfree(xattr_name);
 	if(err) {
 		return -err;
 	}
 	err = zfs_write(xvp, &uio, 0, (cred_t *)cred, NULL);
-	put_cred(cred);
+	LZFS_OPSTAT_IO(0, size);
+	LZFS_OPSTAT_RC(-err);
+	lzfs_attr_invalidate(LZFS_VTOI(dvp));
+	lzfs_io_account(LZFS_XATTR_INODE->i_sb, LZFS_IO_XATTR_WRITE,
+			size - uio.uio_resid);
+	task_io_account_write(size - uio.uio_resid);
 	if(err) {
 		return -err;
 	}
@@ -122,6 +132,7 @@ lzfs_xattr_user_list(struct dentry *dentry, char *list, size_t list_size,
 #endif
 {
 	const size_t total_len = name_len + 1;
+	LZFS_OPSTAT(LZFS_XATTR_INODE, XATTR_LIST);
 
 	if (list && total_len <= list_size) {
 		memcpy(list, name, name_len);
@@ -0,0 +1,110 @@
+#!/bin/sh
+#
+# Data path benchmark suite.
+#
+# Creates a pool on a sparse file under /tmp, mounts a dataset of it
+# through lzfs and runs every lzfs_databench workload at each block size.
+# The dataset is remounted before each run so no page cache survives from
+# the previous one; the ARC does, the pool being created fresh per suite.
+# Results go to stdout, or to -O file, as one JSON document tagged with
+# the lzfs git revision, the kernel and the mount options, so runs of two
+# releases can be compared.
+#
+# Needs root, the zfs and lzfs modules loaded and the zpool command.
+#
+# usage: lzfs_bench.sh [-o mntopts] [-b "bs ..."] [-S size] [-s seconds]
+#                      [-p poolsize] [-O out.json]
+
+SRCDIR=$(cd "$(dirname "$0")/.." && pwd)
+DATABENCH=$SRCDIR/scripts/lzfs_databench
+
+MNTOPTS=defaults
+BLOCKSIZES="4k 64k 1m"
+SIZE=256m
+SECONDS_=5
+POOLSIZE=2g
+OUT=
+
+WORKLOADS="seqwrite seqread randwrite randread mmapwrite mmapread fsync append"
+
+usage() {
+	echo "usage: $0 [-o mntopts] [-b \"bs ...\"] [-S size] [-s seconds]" \
+	    "[-p poolsize] [-O out.json]" >&2
+	exit 2
+}
+
+while getopts "o:b:S:s:p:O:" opt; do
+	case $opt in
+	o) MNTOPTS=$OPTARG ;;
+	b) BLOCKSIZES=$OPTARG ;;
+	S) SIZE=$OPTARG ;;
+	s) SECONDS_=$OPTARG ;;
+	p) POOLSIZE=$OPTARG ;;
+	O) OUT=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+[ $OPTIND -gt $# ] || usage
+
+if [ ! -x "$DATABENCH" ]; then
+	echo "$DATABENCH not built, run make in $SRCDIR/scripts" >&2
+	exit 1
+fi
+
+POOL=lzfsbench$$
+IMG=/tmp/$POOL.img
+MNT=/tmp/$POOL.mnt
+RESULTS=/tmp/$POOL.results
+
+cleanup() {
+	umount "$MNT" 2>/dev/null
+	zpool destroy -f "$POOL" 2>/dev/null
+	rm -rf "$IMG" "$MNT" "$RESULTS"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+remount() {
+	umount "$MNT" 2>/dev/null
+	mount -t zfs -o "$MNTOPTS" "$POOL/bench" "$MNT"
+}
+
+REVISION=$(cd "$SRCDIR" && git describe --always --dirty 2>/dev/null)
+if [ -z "$REVISION" ]; then
+	REVISION=$(awk '/^Version:/ { v = $2 } /^Release:/ { r = $2 }
+	    END { print v "-" r }' "$SRCDIR/META")
+fi
+SRCVERSION=$(cat /sys/module/lzfs/srcversion 2>/dev/null)
+
+truncate -s "$POOLSIZE" "$IMG" || exit 1
+zpool create -f -m none "$POOL" "$IMG" || exit 1
+zfs create -o mountpoint=legacy "$POOL/bench" || exit 1
+mkdir -p "$MNT"
+remount || exit 1
+
+: > "$RESULTS"
+for bs in $BLOCKSIZES; do
+	for w in $WORKLOADS; do
+		remount || exit 1
+		if ! "$DATABENCH" -b "$bs" -S "$SIZE" -s "$SECONDS_" \
+		    "$w" "$MNT" >> "$RESULTS"; then
+			echo "$w at bs $bs failed" >&2
+			exit 1
+		fi
+	done
+	rm -f "$MNT/databench.dat"
+done
+
+{
+	echo "{"
+	echo "  \"revision\": \"$REVISION\","
+	echo "  \"srcversion\": \"$SRCVERSION\","
+	echo "  \"kernel\": \"$(uname -r)\","
+	echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+	echo "  \"mntopts\": \"$MNTOPTS\","
+	echo "  \"size\": \"$SIZE\","
+	echo "  \"results\": ["
+	sed -e 's/^/    /' -e '$!s/$/,/' "$RESULTS"
+	echo "  ]"
+	echo "}"
+} > "${OUT:-/dev/stdout}"
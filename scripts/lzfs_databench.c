@@ -0,0 +1,367 @@
+/*
+ *  This file is part of the LZPL: Linux ZFS Posix Layer
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+/*
+ * Data path benchmark.
+ *
+ * Runs one workload against dir/databench.dat and prints the result as a
+ * single line JSON object, lzfs_bench.sh collects them.  Workloads:
+ *
+ *	seqwrite	write the file front to back, fsync at the end
+ *	seqread		read it front to back
+ *	randwrite	size / bs writes at random aligned offsets, then fsync
+ *	randread	size / bs reads at random aligned offsets
+ *	mmapwrite	store to a shared mapping of the file, then msync
+ *	mmapread	load from a shared mapping of the file
+ *	fsync		bs sized writes, each followed by fsync
+ *	append		bs sized O_APPEND records
+ *
+ * The last two run for -s seconds or until the file reaches -S bytes,
+ * whichever comes first, so they cannot fill a small pool.
+ *
+ * The read and rewrite workloads use the file left by an earlier
+ * seqwrite, or lay one out first if there is none.  The random offsets
+ * come from a fixed seed so runs are comparable.
+ *
+ * usage: lzfs_databench [-b bs] [-S size] [-s seconds] workload dir
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+static char path[4096];
+static size_t bs = 128 * 1024;
+static off_t size = 256 * 1024 * 1024;
+static int seconds = 5;
+static char *buf;
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec / 1000000.0);
+}
+
+static void
+report(const char *workload, unsigned long long ops,
+    unsigned long long bytes, double secs)
+{
+	printf("{\"workload\": \"%s\", \"bs\": %zu, \"size\": %lld, "
+	    "\"ops\": %llu, \"bytes\": %llu, \"secs\": %.3f, "
+	    "\"ops_per_s\": %.1f, \"mb_per_s\": %.2f}\n",
+	    workload, bs, (long long) size, ops, bytes, secs,
+	    ops / secs, bytes / secs / (1024 * 1024));
+	fflush(stdout);
+}
+
+/* the next random block of the file, from a fixed sequence */
+static off_t
+rand_off(void)
+{
+	off_t blocks = size / bs;
+
+	return ((off_t) (((unsigned long long) random() << 31 | random()) %
+	    blocks) * bs);
+}
+
+/* a byte count with an optional k, m or g suffix */
+static long long
+parse_size(const char *arg)
+{
+	char *end;
+	long long n = strtoll(arg, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G':
+		n <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		n <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		n <<= 10;
+	}
+	return (n);
+}
+
+static int
+fail(const char *what)
+{
+	perror(what);
+	return (-1);
+}
+
+static int
+open_file(int flags)
+{
+	int fd = open(path, flags, 0644);
+
+	if (fd < 0)
+		perror(path);
+	return (fd);
+}
+
+static int
+seq_write(void)
+{
+	off_t done;
+	int fd;
+
+	if ((fd = open_file(O_CREAT | O_TRUNC | O_WRONLY)) < 0)
+		return (-1);
+	for (done = 0; done < size; done += bs)
+		if (write(fd, buf, bs) != (ssize_t) bs)
+			return (fail("write"));
+	if (fsync(fd))
+		return (fail("fsync"));
+	close(fd);
+	return (0);
+}
+
+/* lay the file out unless an earlier seqwrite left one of the right size */
+static int
+prepare(void)
+{
+	struct stat st;
+
+	if (stat(path, &st) == 0 && st.st_size == size)
+		return (0);
+	return (seq_write());
+}
+
+static int
+bench_seqwrite(void)
+{
+	double start = now();
+
+	if (seq_write())
+		return (-1);
+	report("seqwrite", size / bs, size, now() - start);
+	return (0);
+}
+
+static int
+bench_seqread(void)
+{
+	unsigned long long ops = 0, bytes = 0;
+	double start;
+	ssize_t n;
+	int fd;
+
+	if (prepare() || (fd = open_file(O_RDONLY)) < 0)
+		return (-1);
+	start = now();
+	while ((n = read(fd, buf, bs)) > 0) {
+		ops++;
+		bytes += n;
+	}
+	if (n < 0)
+		return (fail("read"));
+	report("seqread", ops, bytes, now() - start);
+	close(fd);
+	return (0);
+}
+
+static int
+bench_randwrite(void)
+{
+	unsigned long long i, ops = size / bs;
+	double start;
+	int fd;
+
+	if (prepare() || (fd = open_file(O_WRONLY)) < 0)
+		return (-1);
+	start = now();
+	for (i = 0; i < ops; i++)
+		if (pwrite(fd, buf, bs, rand_off()) != (ssize_t) bs)
+			return (fail("pwrite"));
+	if (fsync(fd))
+		return (fail("fsync"));
+	report("randwrite", ops, ops * bs, now() - start);
+	close(fd);
+	return (0);
+}
+
+static int
+bench_randread(void)
+{
+	unsigned long long i, ops = size / bs;
+	double start;
+	int fd;
+
+	if (prepare() || (fd = open_file(O_RDONLY)) < 0)
+		return (-1);
+	start = now();
+	for (i = 0; i < ops; i++)
+		if (pread(fd, buf, bs, rand_off()) != (ssize_t) bs)
+			return (fail("pread"));
+	report("randread", ops, ops * bs, now() - start);
+	close(fd);
+	return (0);
+}
+
+static int
+bench_mmap(int rw)
+{
+	volatile char sink = 0;
+	double start;
+	off_t off;
+	char *map;
+	int fd;
+
+	if (prepare() || (fd = open_file(rw ? O_RDWR : O_RDONLY)) < 0)
+		return (-1);
+	map = mmap(NULL, size, rw ? PROT_READ | PROT_WRITE : PROT_READ,
+	    MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return (fail("mmap"));
+
+	start = now();
+	for (off = 0; off < size; off += bs) {
+		if (rw)
+			memcpy(map + off, buf, bs);
+		else
+			memcpy(buf, map + off, bs);
+		sink += buf[0];
+	}
+	if (rw && msync(map, size, MS_SYNC))
+		return (fail("msync"));
+	report(rw ? "mmapwrite" : "mmapread", size / bs, size, now() - start);
+
+	munmap(map, size);
+	close(fd);
+	return (0);
+}
+
+/* small records, each one durable before the next, as a database log */
+static int
+bench_fsync(void)
+{
+	unsigned long long ops = 0;
+	double start, end;
+	int fd;
+
+	if ((fd = open_file(O_CREAT | O_TRUNC | O_WRONLY)) < 0)
+		return (-1);
+	start = now();
+	end = start + seconds;
+	do {
+		if (write(fd, buf, bs) != (ssize_t) bs)
+			return (fail("write"));
+		if (fsync(fd))
+			return (fail("fsync"));
+		ops++;
+	} while (now() < end && (off_t) (ops * bs) < size);
+	report("fsync", ops, ops * bs, now() - start);
+	close(fd);
+	return (0);
+}
+
+static int
+bench_append(void)
+{
+	unsigned long long ops = 0;
+	double start, end;
+	int fd;
+
+	if ((fd = open_file(O_CREAT | O_TRUNC | O_WRONLY | O_APPEND)) < 0)
+		return (-1);
+	start = now();
+	end = start + seconds;
+	do {
+		if (write(fd, buf, bs) != (ssize_t) bs)
+			return (fail("write"));
+		ops++;
+	} while (now() < end && (off_t) (ops * bs) < size);
+	report("append", ops, ops * bs, now() - start);
+	close(fd);
+	return (0);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *workload;
+	int c, rc;
+
+	while ((c = getopt(argc, argv, "b:S:s:")) != -1) {
+		switch (c) {
+		case 'b':
+			bs = parse_size(optarg);
+			break;
+		case 'S':
+			size = parse_size(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 2 || bs < 1 || size < (off_t) bs || seconds < 1)
+		goto usage;
+	workload = argv[optind];
+	snprintf(path, sizeof (path), "%s/databench.dat", argv[optind + 1]);
+
+	/* whole blocks only, the random workloads pick block offsets */
+	size -= size % bs;
+	if (!(buf = malloc(bs))) {
+		fprintf(stderr, "out of memory\n");
+		return (1);
+	}
+	memset(buf, 0xa5, bs);
+	srandom(1);
+
+	if (strcmp(workload, "seqwrite") == 0)
+		rc = bench_seqwrite();
+	else if (strcmp(workload, "seqread") == 0)
+		rc = bench_seqread();
+	else if (strcmp(workload, "randwrite") == 0)
+		rc = bench_randwrite();
+	else if (strcmp(workload, "randread") == 0)
+		rc = bench_randread();
+	else if (strcmp(workload, "mmapwrite") == 0)
+		rc = bench_mmap(1);
+	else if (strcmp(workload, "mmapread") == 0)
+		rc = bench_mmap(0);
+	else if (strcmp(workload, "fsync") == 0)
+		rc = bench_fsync();
+	else if (strcmp(workload, "append") == 0)
+		rc = bench_append();
+	else
+		goto usage;
+
+	free(buf);
+	return (rc ? 1 : 0);
+usage:
+	fprintf(stderr, "usage: %s [-b bs] [-S size] [-s seconds] "
+	    "seqwrite|seqread|randwrite|randread|mmapwrite|mmapread|"
+	    "fsync|append dir\n", argv[0]);
+	return (2);
+}
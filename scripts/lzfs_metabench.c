@@ -0,0 +1,418 @@
+/*
+ *  This file is part of the LZPL: Linux ZFS Posix Layer
+ *
+ *  Copyright (c) 2010 Knowledge Quest Infotech Pvt. Ltd.
+ *  Produced at Knowledge Quest Infotech Pvt. Ltd.
+ *  All Rights Reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA.
+ */
+
+/*
+ * Metadata scalability benchmark.
+ *
+ * For 1, 2, 4 ... maxthreads threads, every thread runs these phases in
+ * turn, each for a fixed time, on files of its own:
+ *
+ *	create		creat(2) of new names		lookup, create
+ *	mkdir		mkdir(2) of new names		lookup, mkdir
+ *	lookup		stat(2) of missing names	lookup
+ *	getattr		stat(2) of the created files	getattr
+ *	sharedstat	stat(2) of thread 0's files	getattr
+ *	setattr		chmod(2) of the created files	setattr
+ *	rename		rename(2) a file away and back	rename
+ *	unlink		unlink(2) of the created files	unlink
+ *
+ * The last column is the lzfs entry point each phase drives.  Every
+ * lookup name is new, so none is answered by the dcache.  A rename
+ * counts as one op, each phase ends early once a thread runs out of
+ * files.  In sharedstat all threads stat the same files, so per thread
+ * throughput that collapses as threads are added points at a cache line
+ * shared by the stat path, e.g. the reference count of the caller's
+ * cred.  -p runs a single phase, after an unreported create phase if it
+ * needs files; -p sharedstat is what lzfs_statbench used to measure.
+ *
+ * In the "shared" layout all threads work in one directory, in the
+ * "private" layout each thread has a directory of its own.  Aggregate
+ * throughput that stops growing as threads are added in the private
+ * layout points at a lock or cache line shared by the whole mount, in the
+ * shared layout only at one of the directory.
+ *
+ * The exit status is nonzero if any run failed.
+ *
+ * usage: lzfs_metabench [-t maxthreads] [-n maxfiles] [-s seconds]
+ *                       [-l shared|private] [-p phase] dir
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+/* one per thread, each on cache lines of its own */
+typedef struct worker {
+	char		w_dir[1024];
+	int		w_id;
+	unsigned long	w_nfiles;	/* created by the create phase */
+	unsigned long	w_ndirs;	/* created by the mkdir phase */
+	unsigned long	w_ops;		/* done in the current phase */
+	unsigned long	w_unlinked;
+	char		w_pad[64];
+} worker_t;
+
+/* ops done by one call, 0 when there is nothing left to do, -1 on error */
+typedef int (*phase_fn_t)(worker_t *, char *);
+
+static const char *dir;
+static const char *only_phase;
+static unsigned long maxfiles = 100000;
+static volatile int stop;
+static volatile int nfinished;
+static phase_fn_t phase;
+
+static char *
+file_name(worker_t *w, char *buf, const char *prefix, unsigned long i)
+{
+	snprintf(buf, 4096, "%s/%s.%d.%lu", w->w_dir, prefix, w->w_id, i);
+	return (buf);
+}
+
+static int
+do_create(worker_t *w, char *path)
+{
+	int fd;
+
+	if (w->w_nfiles == maxfiles)
+		return (0);
+	fd = open(file_name(w, path, "f", w->w_nfiles),
+	    O_CREAT | O_EXCL | O_WRONLY, 0644);
+	if (fd < 0)
+		return (-1);
+	close(fd);
+	w->w_nfiles++;
+	return (1);
+}
+
+static int
+do_mkdir(worker_t *w, char *path)
+{
+	if (w->w_ndirs == maxfiles)
+		return (0);
+	if (mkdir(file_name(w, path, "d", w->w_ndirs), 0755))
+		return (-1);
+	w->w_ndirs++;
+	return (1);
+}
+
+static int
+do_lookup(worker_t *w, char *path)
+{
+	struct stat st;
+
+	if (stat(file_name(w, path, "miss", w->w_ops), &st) == 0 ||
+	    errno != ENOENT)
+		return (-1);
+	return (1);
+}
+
+static int
+do_getattr(worker_t *w, char *path)
+{
+	struct stat st;
+
+	if (stat(file_name(w, path, "f", w->w_ops % w->w_nfiles), &st))
+		return (-1);
+	return (1);
+}
+
+/* the workers are one array, thread 0's files are everybody's */
+static int
+do_sharedstat(worker_t *w, char *path)
+{
+	worker_t *w0 = w - w->w_id;
+	struct stat st;
+
+	if (stat(file_name(w0, path, "f", w->w_ops % w0->w_nfiles), &st))
+		return (-1);
+	return (1);
+}
+
+static int
+do_setattr(worker_t *w, char *path)
+{
+	mode_t mode = (w->w_ops & 1) ? 0600 : 0644;
+
+	if (chmod(file_name(w, path, "f", w->w_ops % w->w_nfiles), mode))
+		return (-1);
+	return (1);
+}
+
+/* away and back, so a phase cut short leaves every file where it was */
+static int
+do_rename(worker_t *w, char *path)
+{
+	char tmp[4096];
+	unsigned long i = (w->w_ops / 2) % w->w_nfiles;
+
+	file_name(w, path, "f", i);
+	file_name(w, tmp, "r", i);
+	if (rename(path, tmp) || rename(tmp, path))
+		return (-1);
+	return (2);
+}
+
+static int
+do_unlink(worker_t *w, char *path)
+{
+	if (w->w_unlinked == w->w_nfiles)
+		return (0);
+	if (unlink(file_name(w, path, "f", w->w_unlinked)))
+		return (-1);
+	w->w_unlinked++;
+	return (1);
+}
+
+static const struct {
+	const char	*name;
+	phase_fn_t	fn;
+} phases[] = {
+	{ "create",	do_create },
+	{ "mkdir",	do_mkdir },
+	{ "lookup",	do_lookup },
+	{ "getattr",	do_getattr },
+	{ "sharedstat",	do_sharedstat },
+	{ "setattr",	do_setattr },
+	{ "rename",	do_rename },
+	{ "unlink",	do_unlink },
+};
+static const int nphases = sizeof (phases) / sizeof (phases[0]);
+
+static void *
+phase_thread(void *arg)
+{
+	worker_t *w = arg;
+	char path[4096];
+	int n;
+
+	while (!stop) {
+		n = phase(w, path);
+		if (n <= 0) {
+			if (n < 0)
+				perror(path);
+			break;
+		}
+		w->w_ops += n;
+	}
+	__sync_fetch_and_add(&nfinished, 1);
+	return (NULL);
+}
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec / 1000000.0);
+}
+
+/*
+ * Run one phase on all workers until the time is up or every worker ran
+ * out of files, whichever comes first.
+ */
+static int
+run_phase(const char *layout, int p, worker_t *w, int nthreads, int seconds,
+    int report)
+{
+	pthread_t *tids = calloc(nthreads, sizeof (pthread_t));
+	unsigned long total = 0;
+	double start, end;
+	int i;
+
+	if (!tids) {
+		fprintf(stderr, "out of memory\n");
+		return (-1);
+	}
+
+	stop = 0;
+	nfinished = 0;
+	phase = phases[p].fn;
+	for (i = 0; i < nthreads; i++)
+		w[i].w_ops = 0;
+
+	start = now();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&tids[i], NULL, phase_thread, &w[i]);
+	while (nfinished < nthreads && now() < start + seconds)
+		usleep(10000);
+	stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(tids[i], NULL);
+		total += w[i].w_ops;
+	}
+	end = now();
+
+	if (report) {
+		printf("%-8s %-10s %8d %14.0f %14.0f\n", layout,
+		    phases[p].name, nthreads, total / (end - start),
+		    total / (end - start) / nthreads);
+		fflush(stdout);
+	}
+
+	free(tids);
+	return (0);
+}
+
+static int
+run(const char *layout, int nthreads, int seconds)
+{
+	worker_t *w = calloc(nthreads, sizeof (worker_t));
+	unsigned long j;
+	int i, p, rc = 0;
+
+	if (!w) {
+		fprintf(stderr, "out of memory\n");
+		return (-1);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		w[i].w_id = i;
+		if (strcmp(layout, "shared") == 0)
+			snprintf(w[i].w_dir, sizeof (w[i].w_dir), "%s/shared",
+			    dir);
+		else
+			snprintf(w[i].w_dir, sizeof (w[i].w_dir), "%s/t%d",
+			    dir, i);
+		if (mkdir(w[i].w_dir, 0755) && errno != EEXIST) {
+			perror(w[i].w_dir);
+			rc = -1;
+			goto out;
+		}
+	}
+
+	for (p = 0; p < nphases; p++) {
+		int selected = !only_phase ||
+		    strcmp(only_phase, phases[p].name) == 0;
+
+		/* -p: create still runs, unreported, for phases needing files */
+		if (!selected && (phases[p].fn != do_create ||
+		    strcmp(only_phase, "lookup") == 0 ||
+		    strcmp(only_phase, "mkdir") == 0))
+			continue;
+
+		/* a thread that could not create a file has nothing to do */
+		for (i = 0; i < nthreads; i++)
+			if (w[i].w_nfiles == 0 && phases[p].fn != do_create &&
+			    phases[p].fn != do_mkdir &&
+			    phases[p].fn != do_lookup)
+				break;
+		if (i < nthreads) {
+			fprintf(stderr, "%s: no files created\n", layout);
+			rc = -1;
+			break;
+		}
+		if ((rc = run_phase(layout, p, w, nthreads, seconds,
+		    selected)))
+			break;
+	}
+
+	/* what the unlink phase did not get to, and the directories */
+	for (i = 0; i < nthreads; i++) {
+		char path[4096];
+
+		for (j = w[i].w_unlinked; j < w[i].w_nfiles; j++)
+			unlink(file_name(&w[i], path, "f", j));
+		for (j = 0; j < w[i].w_ndirs; j++)
+			rmdir(file_name(&w[i], path, "d", j));
+	}
+out:
+	for (i = 0; i < nthreads; i++)
+		rmdir(w[i].w_dir);
+	free(w);
+	return (rc);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *layouts[] = { "shared", "private" };
+	int maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *only = NULL;
+	int seconds = 5;
+	int c, l, n, p, rc = 0;
+
+	while ((c = getopt(argc, argv, "t:n:s:l:p:")) != -1) {
+		switch (c) {
+		case 't':
+			maxthreads = atoi(optarg);
+			break;
+		case 'n':
+			maxfiles = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'l':
+			only = optarg;
+			if (strcmp(only, "shared") && strcmp(only, "private"))
+				goto usage;
+			break;
+		case 'p':
+			only_phase = optarg;
+			for (p = 0; p < nphases; p++)
+				if (strcmp(only_phase, phases[p].name) == 0)
+					break;
+			if (p == nphases)
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || maxthreads < 1 || maxfiles < 1 ||
+	    seconds < 1)
+		goto usage;
+	dir = argv[optind];
+	if (strlen(dir) > 900) {
+		fprintf(stderr, "%s: path too long\n", dir);
+		return (1);
+	}
+
+	printf("%-8s %-10s %8s %14s %14s\n", "layout", "op", "threads",
+	    "ops/s", "ops/s/thread");
+	for (l = 0; l < 2; l++) {
+		if (only && strcmp(only, layouts[l]))
+			continue;
+		/* 1, 2, 4 ... and always finish with maxthreads */
+		for (n = 1; ; n = (n * 2 < maxthreads) ? n * 2 : maxthreads) {
+			if (run(layouts[l], n, seconds)) {
+				rc = 1;
+				break;
+			}
+			if (n == maxthreads)
+				break;
+		}
+	}
+	return (rc);
+usage:
+	fprintf(stderr, "usage: %s [-t maxthreads] [-n maxfiles] [-s seconds] "
+	    "[-l shared|private] [-p phase] dir\n", argv[0]);
+	return (2);
+}
@@ -0,0 +1,103 @@
+#!/bin/sh
+#
+# Durability test for "writeback" mounts, whose buffered writes sit dirty
+# in the page cache until writeback hands them to zfs.
+#
+# Creates a pool on a sparse file under /tmp and checks that data written
+# just before each of these survives it:
+#
+#	umount		remount the dataset and compare the file
+#	sync		snapshot the dataset without unmounting and compare
+#			the file in the snapshot, which only holds what zfs had
+#	fsync		as sync, the file written with conv=fsync
+#
+# Needs root, the zfs and lzfs modules loaded and the zpool command.
+# Exits nonzero on the first case that fails.
+#
+# usage: lzfs_writeback_test.sh [-o mntopts] [-S size] [-p poolsize]
+
+MNTOPTS=writeback
+SIZE=64m
+POOLSIZE=1g
+
+usage() {
+	echo "usage: $0 [-o mntopts] [-S size] [-p poolsize]" >&2
+	exit 2
+}
+
+while getopts "o:S:p:" opt; do
+	case $opt in
+	o) MNTOPTS=$OPTARG ;;
+	S) SIZE=$OPTARG ;;
+	p) POOLSIZE=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+[ $OPTIND -gt $# ] || usage
+
+POOL=lzfswbtest$$
+IMG=/tmp/$POOL.img
+MNT=/tmp/$POOL.mnt
+SNAPMNT=/tmp/$POOL.snap
+REF=/tmp/$POOL.ref
+
+cleanup() {
+	umount "$SNAPMNT" 2>/dev/null
+	umount "$MNT" 2>/dev/null
+	zpool destroy -f "$POOL" 2>/dev/null
+	rm -rf "$IMG" "$MNT" "$SNAPMNT" "$REF"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+fail() {
+	echo "FAIL: $1" >&2
+	exit 1
+}
+
+mount_fs() {
+	mount -t zfs -o "$MNTOPTS" "$POOL/test" "$MNT" ||
+	    fail "mount -o $MNTOPTS"
+}
+
+# compare $REF with the file at $1
+check() {
+	cmp -s "$REF" "$1" || fail "$CASE: $1 differs from what was written"
+	echo "PASS: $CASE"
+}
+
+# compare $REF with the file as zfs has it, through a snapshot
+check_snapshot() {
+	zfs snapshot "$POOL/test@$CASE" || fail "$CASE: zfs snapshot"
+	mount -t zfs "$POOL/test@$CASE" "$SNAPMNT" ||
+	    fail "$CASE: mount snapshot"
+	check "$SNAPMNT/$CASE.dat"
+	umount "$SNAPMNT"
+}
+
+truncate -s "$POOLSIZE" "$IMG" || exit 1
+zpool create -f -m none "$POOL" "$IMG" || exit 1
+zfs create -o mountpoint=legacy "$POOL/test" || exit 1
+mkdir -p "$MNT" "$SNAPMNT"
+mount_fs
+
+dd if=/dev/urandom of="$REF" bs="$SIZE" count=1 iflag=fullblock \
+    2>/dev/null || exit 1
+
+CASE=umount
+cp "$REF" "$MNT/$CASE.dat" || fail "$CASE: write"
+umount "$MNT" || fail "$CASE: umount"
+mount_fs
+check "$MNT/$CASE.dat"
+
+CASE=sync
+cp "$REF" "$MNT/$CASE.dat" || fail "$CASE: write"
+sync
+check_snapshot
+
+CASE=fsync
+dd if="$REF" of="$MNT/$CASE.dat" bs=128k conv=fsync 2>/dev/null ||
+    fail "$CASE: write"
+check_snapshot
+
+exit 0